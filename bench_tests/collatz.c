@@ -0,0 +1,18 @@
+int steps(int n) {
+    int count = 0;
+    while (n != 1) {
+        if (n / 2 * 2 == n)
+            n = n / 2;
+        else
+            n = 3 * n + 1;
+        count = count + 1;
+    }
+    return count;
+}
+
+int main() {
+    int total = 0;
+    for (int n = 1; n < 30000; n = n + 1)
+        total = total + steps(n);
+    return total;
+}
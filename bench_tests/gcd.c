@@ -0,0 +1,14 @@
+int gcd(int a, int b) {
+    if (b == 0)
+        return a;
+    return gcd(b, a - a / b * b);
+}
+
+int main() {
+    int sum = 0;
+    for (int i = 1; i <= 400; i = i + 1) {
+        for (int j = 1; j <= 400; j = j + 1)
+            sum = sum + gcd(i, j);
+    }
+    return sum;
+}
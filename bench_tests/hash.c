@@ -0,0 +1,17 @@
+int mix(int h, int x) {
+    h = h * 31 + x;
+    return h - h / 1000003 * 1000003;
+}
+
+int main() {
+    int h = 17;
+    int x = 0;
+    for (int i = 0; i < 2000000; i = i + 1) {
+        x = (x * 7 + i / 3 - i / 5 * 5 + h / 1024) / 3 + i / 7;
+        x = x - x / 65536 * 65536;
+        h = mix(h, x - i / 9);
+        if (h < 0)
+            h = -h;
+    }
+    return h + x;
+}
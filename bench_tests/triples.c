@@ -0,0 +1,14 @@
+int main() {
+    int count = 0;
+    for (int c = 1; c <= 250; c = c + 1) {
+        for (int b = 1; b < c; b = b + 1) {
+            int a = 1;
+            while (a < b) {
+                if (a * a + b * b == c * c)
+                    count = count + 1;
+                a = a + 1;
+            }
+        }
+    }
+    return count;
+}
@@ -2,7 +2,7 @@
  * Cvv Compiler.
  * Custom language based on C.
  * Written on C++17
- * 32-bit architecture. Intel ASM.
+ * Targets i386 (default) and x86-64. Output is an ELF object, or Intel syntax assembly with -S.
  *
  * Original series: https://norasandler.com/
  */
@@ -13,6 +13,34 @@
 #include <vector>
 #include <climits>
 #include <stack>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <cstdint>
+#include <functional>
+#include <cstring>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <iomanip>
+#include <ctime>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /*
  * List of tokens lexer can return.
@@ -80,6 +108,21 @@ enum types_list {
     SKIP,               //20
     FUNC_PARAMS,        //21
     FUNC_CALL,          //22
+    SHORT_CIRC,         //23
+    WHILE_NEXT,         //24
+    INLINE_BEGIN,       //25
+    ARG_BIND,           //26
+    INLINE_RET,         //27
+    INLINE_END,         //28
+    CALL_BEGIN,         //29
+    EXPR_END,           //30
+};
+const char *type_names[EXPR_END + 1] = {
+    "FUNC_DECL", "CONSTANT", "RET", "UN_OP", "BI_OP", "VARREF", "VARASSIGN", "VARDECL",
+    "COND_QUEST", "COND_COLON", "COND_END", "IF_ELSE", "IF_BODY", "IF_END", "O_BR", "C_BR",
+    "WHILE_LABEL", "WHILE_EXPR", "WHILE_END", "NEXT", "SKIP", "FUNC_PARAMS", "FUNC_CALL",
+    "SHORT_CIRC", "WHILE_NEXT", "INLINE_BEGIN", "ARG_BIND", "INLINE_RET", "INLINE_END",
+    "CALL_BEGIN", "EXPR_END",
 };
 
 /*
@@ -94,6 +137,9 @@ private:
     std::string op;             // operation
     std::vector <std::string> func_param_types;
     int inum;
+    int reg;                    // register of variable, -1 if it is on the stack; of a call, its arguments in registers
+    int version;                // SSA value of variable reference or assignment
+    int slot;                   // stack slot of variable, -1 if it has none
 
 public:
     AST(){
@@ -104,6 +150,9 @@ public:
         var_name = "";
         op = "";
         inum = 0;
+        reg = -1;
+        version = 0;
+        slot = -1;
     }
     // set AST fields
     void set_type(int value){
@@ -124,6 +173,15 @@ public:
     void set_inum(int value){
         inum = value;
     }
+    void set_reg(int value){
+        reg = value;
+    }
+    void set_version(int value){
+        version = value;
+    }
+    void set_slot(int value){
+        slot = value;
+    }
 
     // check AST fields
     int check_type(){
@@ -147,10 +205,84 @@ public:
     int check_inum(){
         return inum;
     }
+    int check_reg(){
+        return reg;
+    }
+    int check_version(){
+        return version;
+    }
+    int check_slot(){
+        return slot;
+    }
 };
 
 typedef std::vector<std::pair<std::string, int>> dvar_t;    // list of defined variables.
 typedef std::vector<std::pair<int, std::string>> tokens_t;  // type to contain list of tokens in pairs type - value.
+class Assembler;
+struct chunk_t;
+
+/*
+ * Errors.
+ * Message is written to diag, log of the file being compiled (each thread of the driver
+ * has its own), then compile_error_t is thrown and the file fails.
+ */
+struct compile_error_t {};
+thread_local std::ostream *diag = &std::cout;
+thread_local bool quiet = false;    // -q: only errors are written (set for each file or request).
+/*
+ * Time report (--time-report, or --time-report=json for a JSON object on one line).
+ * Wall and CPU time of each phase (summed over functions for those run on each of them)
+ * and counters of the work, for each file, after its messages.
+ */
+enum report_list { REPORT_NONE, REPORT_TEXT, REPORT_JSON };
+int time_report = REPORT_NONE;
+struct report_t {
+    std::vector<std::string> phases;                            // in order of the first end
+    std::map<std::string, std::pair<double, double>> times;     // wall and CPU seconds
+    long bytes = 0;
+    long tokens = 0;
+    std::vector<long> nodes;                                    // by type, from the parser
+    long instructions = 0;
+    long labels = 0;
+    long lookups = 0;                                           // of variables and functions
+};
+thread_local report_t report;
+// Runs a phase, its time is added to the report.
+void timed(const char *phase, const std::function<void()>& run);
+void write_report(const std::string& file, bool failed);
+/*
+ * Benchmark.
+ * --generate=N writes a program of N functions made from --seed=S to stdout: many locals, long
+ * expressions, nested if, for and while, calls. --bench compiles such programs in memory, with
+ * growing number of functions and then growing functions, and writes throughput of each phase,
+ * in MB/s and tokens/s of the source, with its scaling exponent: time grows as size to this
+ * power, about 1 for linear phases, 2 for quadratic. Each program is compiled bench_compiles
+ * times and the least time of each phase is kept; the exponent is the slope of log time
+ * against log size, fitted by least squares over all sizes of the series.
+ */
+std::string synthetic_program(unsigned seed, size_t functions, int statements = 8);
+int benchmark(unsigned seed);
+const int bench_compiles = 5;
+/*
+ * Runtime benchmark (--run-bench, x86-64 Linux only).
+ * Each input (kernels are in bench_tests) is compiled and run in this process as with --jit,
+ * bench_runs times, and the least of each counter is kept: CPU time, and cycles, instructions
+ * and branch misses of user code from perf_event_open when the CPU exposes them (-1 if not).
+ * --baseline=FILE compares with the results in FILE, a kernel is failed if its value differs;
+ * with --save-baseline the results are written there instead. Time and cycles are of the machine
+ * that saved the baseline, instructions and values are of the compiler.
+ */
+struct run_counters_t {
+    int value = 0;
+    long ns = -1;
+    long cycles = -1;
+    long instructions = -1;
+    long branch_misses = -1;
+};
+const int bench_runs = 10;
+int run_bench(const std::vector<std::string>& kernels, const std::string& baseline, bool save);
+// Calls main of the loaded program with the counters enabled.
+run_counters_t count_run(int (*main_function)());
 
 /*
  * Lexer.
@@ -162,25 +294,213 @@ tokens_t lexer(const std::string& input);
  * Transforming list of tokens into an abstract syntax tree (AST).
  */
 std::vector<AST> parser(const tokens_t& tokens);
+/*
+ * Function inliner.
+ * Replaces calls to small (or called only once) non-recursive functions with their bodies.
+ */
+void inline_calls(std::vector<AST>& ast);
+size_t inline_threshold = 40;       // largest body, in AST nodes, inlined at every call site.
+/*
+ * Call graph.
+ * Functions which main doesn't reach through calls are removed. A function is pure if it has
+ * no side effects: all variables are local, so only calls of impure functions or of functions
+ * defined elsewhere can have them. Unused results of pure functions that always return aren't computed.
+ */
+void callgraph(std::vector<AST>& ast);
+/*
+ * Promotion of local variables to registers (mem2reg).
+ * Variables are put in SSA form, with phi functions at joins of control flow, to find
+ * which of them are live at the same time. Those which aren't share a register.
+ * Variables which don't get a register share stack slots of the frame by the same rule.
+ */
+void mem2reg(std::vector<AST>& ast);
+/*
+ * Target: 32-bit Intel (i386, default) or x86-64 (--target=x86-64).
+ * Values are 32-bit on both, so registers are used by their 32-bit part,
+ * except where they are pushed or used in an address.
+ */
+bool x86_64 = false;
+long int word = 4;                  // bytes of a stack slot: push, pop, return address.
+enum regs_list { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+void set_target(const std::string& name);
+// Registers for local variables. Callee-saved, codegen uses only EAX, ECX and EDX otherwise.
+const int var_regs_i386[] = {EBX, ESI, EDI};
+const int var_regs_x86_64[] = {EBX, R12, R13, R14, R15};
+const int *var_regs = var_regs_i386;
+int var_regs_num = 3;
+/*
+ * Calling convention.
+ * First arguments are passed in arg_regs, the rest on the stack, pushed right to left
+ * and removed by the caller. Stack pointer is a multiple of 16 at the call instruction.
+ * Result is returned in EAX. Registers of variables and the frame pointer are preserved
+ * by the callee, EAX, ECX and EDX are not.
+ * i386 passes two arguments in ECX and EDX to functions defined in the module and all of them
+ * on the stack (cdecl) to the others; on x86-64 it is the System V ABI, with six of them
+ * in registers. Callgraph keeps the number in reg of each FUNC_CALL and CALL_BEGIN.
+ */
+const int arg_regs_i386[] = {ECX, EDX};
+const int arg_regs_x86_64[] = {EDI, ESI, EDX, ECX, R8, R9};
+const int *arg_regs = arg_regs_i386;
+int reg_args_num = 2;
+int external_reg_args = 0;          // of functions only declared
+/*
+ * Output: ELF relocatable object (file.o), or assembly text (file.s) with -S.
+ * Path is set by -o, "-" is stdout.
+ */
+bool text_output = false;
+/*
+ * JIT (--jit, x86-64 Linux only).
+ * Machine code is copied into memory mapped writable, then made executable (never both),
+ * and main is called in this process. Its value is returned. Addresses of the functions
+ * are written to /tmp/perf-<pid>.map for perf.
+ */
+bool jit = false;
+int jit_run(Assembler& as);
+// Copies linked code into executable memory. Returns address of each function.
+std::map<std::string, void *> jit_load(Assembler& as);
+/*
+ * Bytecode VM (--vm).
+ * Program is lowered from the nodes into bytecode for a stack machine and run here,
+ * without assembler or linker. Value of main is returned.
+ */
+bool vm = false;
+int vm_run(std::vector<AST>& ast);
+/*
+ * Tiered execution (--tiered, x86-64 Linux only).
+ * Functions start in the VM. Calls and loop iterations are counted per function; past
+ * tier_threshold it is compiled to native code together with the functions it calls, and
+ * its calls in the bytecode are patched to call the native code. Activations already
+ * running stay in the VM.
+ */
+bool tiered = false;
+size_t tier_threshold = 1000;
+/*
+ * Loop-invariant code motion.
+ * Computations inside a loop whose operands are not changed by the loop are moved
+ * in front of it (preheader) and their result is kept in a new local variable.
+ */
+void licm(std::vector<AST>& ast);
+/*
+ * Loop unrolling.
+ * Counted FOR loops with a constant number of iterations are replaced by copies of the body.
+ * Others get a loop doing several iterations per jump, followed by the original loop for the rest.
+ */
+void unroll(std::vector<AST>& ast);
+size_t unroll_budget = 128;         // largest unrolled code, in AST nodes.
+/*
+ * Global value numbering.
+ * Expressions get equal numbers if they compute equal values. A computation whose value is
+ * already computed on every path to it (by a dominating block) takes it from a new local
+ * variable instead. Computations at the start of both arms of an if are moved in front of it.
+ */
+void gvn(std::vector<AST>& ast);
 /*
  * Code generator.
- * Generates assembly code.
+ * Generates machine code into an object file, or assembly code with -S.
  */
-void to_asm(std::vector<AST>& ast);
+void to_asm(std::vector<AST>& ast, Assembler& as);
 
 std::string read_file(const std::string& file_location);    // Source code file into string.
+// Value of a numeric option: text after its name, decimal digits only. Usage error ends the program.
+unsigned long option_number(const std::string& option, const std::string& text);
+/*
+ * Driver.
+ * Compiles every input file into its output (file.c into file.o, or file.s with -S; -o sets
+ * the output of the input before it). Files are compiled on -j threads; logs and status
+ * of the files are written in the order of the inputs. After the optimizations of the whole
+ * program, functions are optimized and generated one by one.
+ */
+void compile(const std::string& input, const std::string& output);
+// Code of the source code. Functions saved in the file at functions_path are reused (incremental).
+std::string generate(const std::string& source, const std::string& functions_path);
+// Lexer, parser and optimizations of the whole program: call graph and inliner.
+std::vector<AST> front_end(const std::string& source);
+// Optimizations inside functions.
+void optimize(std::vector<AST>& nodes);
+/*
+ * Runs job(0) .. job(count - 1) on threads. Each thread takes jobs from the back of its
+ * own queue and, when it is empty, steals from the front of the queues of the others.
+ */
+void run_jobs(size_t count, size_t threads, const std::function<void(size_t)>& job);
+/*
+ * Compilation cache (--cache=DIR).
+ * Output is stored in DIR under the SHA-256 of the compiler version, options changing the
+ * code and the source code; compiling the same source again reads it from there, without
+ * lexer, parser or codegen. Entries are written into a temporary file and renamed into place,
+ * so other compilers see a whole entry or none. Past cache_size bytes (--cache-size=N), the
+ * least recently used entries are removed: a hit updates modification time of its entry.
+ */
+std::string cache_dir;
+size_t cache_size = 64 << 20;
+const char *compiler_version = "cvv (" __DATE__ " " __TIME__ ")";
+std::string sha256(const std::string& data);        // hex digest
+std::string cache_key(const std::string& source);
+// Compiler version and options changing the code.
+std::string options_key();
+bool cache_load(const std::string& key, std::string& output);
+void cache_store(const std::string& key, const std::string& output);
+/*
+ * Incremental builds (--incremental).
+ * Code of each function is saved next to the output (file.o.fp) under its fingerprint:
+ * SHA-256 of the options and of its nodes after the inliner, which have bodies of the callees
+ * inlined into it, and the other calls by name and number of arguments. On rebuild, functions
+ * whose fingerprint is saved are spliced in without optimizations and codegen.
+ */
+bool incremental = false;
+std::string fingerprint(const std::string& options, std::vector<AST>& function);
+std::map<std::string, chunk_t> load_chunks(const std::string& path);
+void save_chunks(const std::string& path, const std::vector<std::pair<std::string, chunk_t>>& chunks);
+/*
+ * Compile server (--serve=SOCKET) and its client (--connect=SOCKET).
+ * Server listens on the Unix socket and compiles source code sent to it with its own options,
+ * on -j threads (one per CPU by default) which stay between requests, each with its buffers.
+ * Client sends each input file (with the options, which must be the same as the server's) and
+ * writes the output and the messages it gets back, as if it compiled the file itself.
+ * Messages are frames: length (4 bytes, little-endian), then data, at most max_frame bytes.
+ * Request is options, source code and "-q" or nothing, answer is status ("ok" or "failed"),
+ * output and messages. Socket is removed when the server is stopped by SIGINT or SIGTERM.
+ */
+std::string connect_path;
+const size_t max_frame = 64 << 20;
+char serve_socket[sizeof(sockaddr_un::sun_path)];      // path removed by the signal handler
+int serve(const std::string& path, size_t threads);
+void compile_remote(const std::string& input, const std::string& output);
+bool write_frame(int fd, const std::string& data);
+bool read_frame(int fd, std::string& data);
 
 // Find variable in declared ones.
 std::pair<int, int> find_var(const std::string& key, const dvar_t& decl_vars);
+// Error if variable is already declared in the scope that starts at decl_vars[scope].
+void check_redefinition(const std::string& key, const dvar_t& decl_vars, size_t scope);
 // Find string in vector.
 bool find_str_vec(const std::string& key, const std::vector<std::string>& vector);
 void out_tokens(const tokens_t& tokens);
 
+// Constant operand of a binary operation: literal, optionally negated. Returns index of the node after it.
+size_t const_operand(std::vector<AST>& ast, size_t current, int& value);
+/*
+ * Instruction selection for multiplication and division by a constant.
+ * Operand is in EAX, result is left in EAX. ECX and EDX may be clobbered.
+ */
+void mul_by_const(Assembler& as, int value);
+void div_by_const(Assembler& as, int value);
+// Magic number and shift for signed division by constant (Hacker's Delight, 10-1).
+std::pair<int, int> div_magic(int divisor);
+// Restores saved registers, ESP and EBP (if function has it) before leaving the function.
+void epilogue(Assembler& as, size_t saved, long int stack_index, bool frame_pointer);
+// Offset from EBP of stack slot of a variable.
+long int func_slot(size_t saved, int slot);
+// Condition code which is true when cc is false.
+int negate_cc(int cc);
+// Condition code which is true when cc is, for operands in the other order.
+int swap_cc(int cc);
+
 
 class Parser{
 private:
     size_t current;
     std::vector<AST> nodes;
+    size_t loops = 0;       // loops the statement is in, for break and continue
 
 public:
     // Push node to AST
@@ -234,20 +554,36 @@ public:
 
             inc_cur();
             if (tokens[current].first == O_PRN){
+                // Stack is aligned for the call before its arguments are pushed.
+                AST node_begin;
+                node_begin.set_type(CALL_BEGIN);
+                push_node(node_begin);
+                size_t begin = nodes.size() - 1;
+
                 inc_cur();
                 if (tokens[current].first != C_PRN){
+                    std::vector<size_t> bounds = {nodes.size()};    // where each argument starts
                     parse_expr(tokens);
+                    bounds.emplace_back(nodes.size());
                     while (tokens[current].first == COMA){
                         inc_cur();
                         parse_expr(tokens);
+                        bounds.emplace_back(nodes.size());
                     }
                     if (tokens[current].first != C_PRN){
-                        std::cout << "No close parentheses in function call: " << tokens[current].second;
-                        exit(0);
+                        *diag << "No close parentheses in function call: " << tokens[current].second;
+                        throw compile_error_t();
                     }
-                    push_node(node_call);
-                    return;
+                    // Arguments are evaluated right to left, so the first one ends up on top.
+                    std::vector<AST> args;
+                    for (size_t arg = bounds.size() - 1; arg-- > 0;){
+                        args.insert(args.end(), nodes.begin() + bounds[arg], nodes.begin() + bounds[arg + 1]);
+                    }
+                    nodes.resize(bounds[0]);
+                    nodes.insert(nodes.end(), args.begin(), args.end());
+                    node_call.set_inum(bounds.size() - 1);     // number of arguments is kept in inum.
                 }
+                nodes[begin].set_inum(node_call.check_inum());
                 push_node(node_call);
                 return;
             } else {
@@ -274,13 +610,13 @@ public:
             inc_cur();
             parse_expr(tokens);
             if (tokens[current].first != C_PRN){
-                std::cout << "No pair to open parentheses: " << tokens[current].second;
-                exit(0);
+                *diag << "No pair to open parentheses: " << tokens[current].second;
+                throw compile_error_t();
             }
             return;
         }
-        std::cout << "Illegal value: " << tokens[current].second << std::endl;
-        exit(0);
+        *diag << "Illegal value: " << tokens[current].second << std::endl;
+        throw compile_error_t();
     }
 
     void parse_term(const tokens_t& tokens){
@@ -348,6 +684,12 @@ public:
         parse_equ(tokens);
         inc_cur();
         while (tokens[current].first == AND){
+            // Right operand is evaluated only if the left one doesn't decide the result.
+            AST node_short;
+            node_short.set_type(SHORT_CIRC);
+            node_short.set_op(tokens[current].second);
+            push_node(node_short);
+
             AST node;
             node.set_type(BI_OP);
             node.set_op(tokens[current].second);
@@ -363,6 +705,12 @@ public:
         parse_log_and(tokens);
         inc_cur();
         while (tokens[current].first == OR){
+            // Right operand is evaluated only if the left one doesn't decide the result.
+            AST node_short;
+            node_short.set_type(SHORT_CIRC);
+            node_short.set_op(tokens[current].second);
+            push_node(node_short);
+
             AST node;
             node.set_type(BI_OP);
             node.set_op(tokens[current].second);
@@ -386,8 +734,8 @@ public:
             inc_cur();
             parse_expr(tokens);
             if (tokens[current].first != COLON){
-                std::cout << "No colon in ternary expression: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No colon in ternary expression: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             AST node_cond_colon;
             node_cond_colon.set_type(COND_COLON);
@@ -437,8 +785,8 @@ public:
             inc_cur();
             parse_expr(tokens);
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement" << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement" << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             AST node;
             node.set_type(RET);
@@ -451,8 +799,6 @@ public:
             o_node.set_type(O_BR);
             push_node(o_node);
 
-            inc_cur();
-            parse_block_item(tokens);
             inc_cur();
             while (tokens[current].first != C_BRACE){
                 parse_block_item(tokens);
@@ -471,9 +817,13 @@ public:
             tokens[current].first == O_PRN){
             parse_expr(tokens);
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
+            // Its value is dropped, so every statement leaves the stack as it was.
+            AST node_end;
+            node_end.set_type(EXPR_END);
+            push_node(node_end);
             return;
         }
         if (tokens[current].first == SEMI){
@@ -484,20 +834,29 @@ public:
         if (tokens[current].first == FOR){
             inc_cur();
             if (tokens[current].first != O_PRN){
-                std::cout << "No open parentheses after FOR: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No open parentheses after FOR: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             inc_cur();
 
+            // Variable declared in the initial clause is visible only in the loop.
+            bool scope = tokens[current].first == KEYWORD;
+            if (scope){
+                AST o_node;
+                o_node.set_type(O_BR);
+                push_node(o_node);
+            }
+
             if (tokens[current].first == KEYWORD){
                 inc_cur();
                 if (tokens[current].first != IDENTIFIER){
-                    std::cout << "Wrong name in variable declaration: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "Wrong name in variable declaration: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
                 AST node;
                 node.set_type(VARDECL);
                 node.set_var_name(tokens[current].second);
+                node.set_inum(1);               // has an initializer
                 push_node(node);
 
                 AST node_assign;
@@ -506,22 +865,26 @@ public:
 
                 inc_cur();
                 if (tokens[current].first != ASSIGN){
-                    std::cout << "Error in variable declaration in an initial clause: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "Error in variable declaration in an initial clause: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
                 inc_cur();
                 parse_expr(tokens);
                 push_node(node_assign);
 
                 if (tokens[current].first != SEMI){
-                    std::cout << "No semicolon after initial clause in FOR: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "No semicolon after initial clause in FOR: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
             } else {
-                parse_expr_opt(tokens);
+                if (!parse_expr_opt(tokens)){
+                    AST node_end;
+                    node_end.set_type(EXPR_END);
+                    push_node(node_end);
+                }
                 if (tokens[current].first != SEMI){
-                    std::cout << "No semicolon after initial clause in FOR: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "No semicolon after initial clause in FOR: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
             }
 
@@ -532,8 +895,8 @@ public:
             inc_cur();
             bool semi = parse_expr_opt(tokens);
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon after controlling expression in FOR: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon after controlling expression in FOR: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
             if (!semi){
@@ -545,10 +908,14 @@ public:
             size_t length = nodes.size();
 
             inc_cur();
-            parse_expr_opt(tokens);
+            if (!parse_expr_opt(tokens)){
+                AST node_end;
+                node_end.set_type(EXPR_END);
+                push_node(node_end);
+            }
             if (tokens[current].first != C_PRN){
-                std::cout << "No close parentheses in FOR statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No close parentheses in FOR statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
             // Swap nodes to achieve wright sequence in AST.
@@ -562,7 +929,14 @@ public:
             }
 
             inc_cur();
+            loops++;
             parse_statement(tokens);
+            loops--;
+
+            // Continue jumps here, to the step expression.
+            AST node_while_next;
+            node_while_next.set_type(WHILE_NEXT);
+            push_node(node_while_next);
 
             index = 0;
             size_t temp_size = temp.size();
@@ -576,6 +950,11 @@ public:
             node_while_end.set_type(WHILE_END);
             push_node(node_while_end);
 
+            if (scope){
+                AST c_node;
+                c_node.set_type(C_BR);
+                push_node(c_node);
+            }
             return;
         }
 
@@ -583,8 +962,8 @@ public:
         if (tokens[current].first == WHILE){
             inc_cur();
             if (tokens[current].first != O_PRN){
-                std::cout << "No open parentheses after WHILE: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No open parentheses after WHILE: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             inc_cur();
 
@@ -592,17 +971,24 @@ public:
             node_while_label.set_type(WHILE_LABEL);
             push_node(node_while_label);
 
+            // Continue jumps here, to the controlling expression.
+            AST node_while_next;
+            node_while_next.set_type(WHILE_NEXT);
+            push_node(node_while_next);
+
             parse_expr(tokens);
             if (tokens[current].first != C_PRN){
-                std::cout << "No close parentheses in WHILE statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No close parentheses in WHILE statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             AST node_while_expr;
             node_while_expr.set_type(WHILE_EXPR);
             push_node(node_while_expr);
 
             inc_cur();
+            loops++;
             parse_statement(tokens);
+            loops--;
 
             AST node_while_end;
             node_while_end.set_type(WHILE_END);
@@ -618,17 +1004,25 @@ public:
             push_node(node_while_label);
 
             inc_cur();
+            loops++;
             parse_statement(tokens);
+            loops--;
             inc_cur();
             if (tokens[current].first != WHILE){
-                std::cout << "No WHILE in DO statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No WHILE in DO statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
+
+            // Continue jumps here, to the controlling expression.
+            AST node_while_next;
+            node_while_next.set_type(WHILE_NEXT);
+            push_node(node_while_next);
+
             inc_cur();
             parse_expr(tokens);
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
             AST node_while_expr;
             node_while_expr.set_type(WHILE_EXPR);
@@ -644,10 +1038,14 @@ public:
         if (tokens[current].first == BREAK){
             inc_cur();
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
+            if (loops == 0){
+                *diag << "Break is not in a loop" << std::endl;
+                throw compile_error_t();
+            }
             AST node;
             node.set_type(SKIP);
             push_node(node);
@@ -658,8 +1056,12 @@ public:
         if (tokens[current].first == CONTINUE){
             inc_cur();
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement: " << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement: " << std::endl;
+                throw compile_error_t();
+            }
+            if (loops == 0){
+                *diag << "Continue is not in a loop" << std::endl;
+                throw compile_error_t();
             }
             AST node;
             node.set_type(NEXT);
@@ -672,16 +1074,16 @@ public:
         if (tokens[current].first == IF){
             inc_cur();
             if (tokens[current].first != O_PRN){
-                std::cout << "No open parentheses in IF statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No open parentheses in IF statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
             inc_cur();
             parse_expr(tokens);
 
             if (tokens[current].first != C_PRN){
-                std::cout << "No close parentheses in IF statement: " << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No close parentheses in IF statement: " << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
             AST node_if;
@@ -709,8 +1111,8 @@ public:
 
             return;
         }
-        std::cout << "Wrong statement: " << tokens[current].second << std::endl;
-        exit(0);
+        *diag << "Wrong statement: " << tokens[current].second << std::endl;
+        throw compile_error_t();
     }
 
     void parse_block_item(const tokens_t& tokens){
@@ -718,12 +1120,13 @@ public:
         if (tokens[current].first == KEYWORD){
             inc_cur();
             if (tokens[current].first != IDENTIFIER){
-                std::cout << "Wrong name in variable declaration" << std::endl;
-                exit(0);
+                *diag << "Wrong name in variable declaration" << std::endl;
+                throw compile_error_t();
             }
             AST node;
             node.set_type(VARDECL);
             node.set_var_name(tokens[current].second);
+            node.set_inum(tokens[current + 1].first == ASSIGN);      // has an initializer
             push_node(node);
 
             AST node_assign;
@@ -738,8 +1141,8 @@ public:
             }
 
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon at the end of the statement3" << std::endl;
-                exit(0);
+                *diag << "No semicolon at the end of the statement3" << std::endl;
+                throw compile_error_t();
             }
             return;
         } else {
@@ -749,14 +1152,14 @@ public:
 
     void parse_function(const tokens_t& tokens){
         if (tokens[current].first != KEYWORD){
-            std::cout << "Wrong type in function declaration: " << tokens[current].second << std::endl;
-            exit(0);
+            *diag << "Wrong type in function declaration: " << tokens[current].second << std::endl;
+            throw compile_error_t();
         }
         inc_cur();
 
         if (tokens[current].first != IDENTIFIER){
-            std::cout << "Illegal name of function: " << tokens[current].second << std::endl;
-            exit(0);
+            *diag << "Illegal name of function: " << tokens[current].second << std::endl;
+            throw compile_error_t();
         }
         // Function declaration node.
         AST node;
@@ -766,8 +1169,8 @@ public:
         inc_cur();
 
         if (tokens[current].first != O_PRN){
-            std::cout << "No open parentheses at function declaration: " << tokens[current].second << std::endl;
-            exit(0);
+            *diag << "No open parentheses at function declaration: " << tokens[current].second << std::endl;
+            throw compile_error_t();
         }
         inc_cur();
 
@@ -775,8 +1178,8 @@ public:
             inc_cur();
 
             if (tokens[current].first != IDENTIFIER){
-                std::cout << "Wrong function parameter name1" << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "Wrong function parameter name1" << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
 
             // Variable declaration node.
@@ -790,14 +1193,14 @@ public:
             while (tokens[current].first == COMA){
                 inc_cur();
                 if (tokens[current].first != KEYWORD){
-                    std::cout << "Wrong type of function parameter: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "Wrong type of function parameter: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
                 inc_cur();
 
                 if (tokens[current].first != IDENTIFIER){
-                    std::cout << "Wrong function parameter name: " << tokens[current].second << std::endl;
-                    exit(0);
+                    *diag << "Wrong function parameter name: " << tokens[current].second << std::endl;
+                    throw compile_error_t();
                 }
                 // Variable declaration node.
                 AST node_vardecl_loop;
@@ -809,8 +1212,8 @@ public:
         }
 
         if (tokens[current].first != C_PRN){
-            std::cout << "No close parentheses at function declaration: " << tokens[current].second << std::endl;
-            exit(0);
+            *diag << "No close parentheses at function declaration: " << tokens[current].second << std::endl;
+            throw compile_error_t();
         }
         inc_cur();
 
@@ -820,8 +1223,6 @@ public:
             o_node.set_type(O_BR);
             push_node(o_node);
 
-            inc_cur();
-            parse_block_item(tokens);
             inc_cur();
             while (tokens[current].first != C_BRACE){
                 parse_block_item(tokens);
@@ -836,436 +1237,4906 @@ public:
             push_node(node_params);
         } else {
             if (tokens[current].first != SEMI){
-                std::cout << "No semicolon after function declaration" << tokens[current].second << std::endl;
-                exit(0);
+                *diag << "No semicolon after function declaration" << tokens[current].second << std::endl;
+                throw compile_error_t();
             }
         }
     }
 };
 
-int main (int argc, char ** argv){
-    // Read source code from file.
-    std::string input = read_file(R"(D:\Winderton\Compiler_cvv\stage5_tests\valid\assign.c)");
-    // Lexer result.
-    tokens_t tokens = lexer(input);
-    std::cout << "Lexer: done\n";
-    out_tokens(tokens);
-    // Parser result.
-    std::vector<AST> nodes = parser(tokens);
-    std::cout << "Parser: done\n";
-    // Code generation.
-    to_asm(nodes);
-    std::cout << "Code generation: done\n";
-    return 0;
-}
-
-// Interaction with variables and constants via stack.
-// AST nodes are in order of assembler generation.
-void to_asm(std::vector<AST>& ast){
-    // File where assembly code is written to.
-    FILE *pfile;
-    pfile = fopen("asm.txt", "w");
+/*
+ * Output sink.
+ * Output is collected in a buffer and written with one write() when the buffer is full
+ * or flushed. Target is a file, a descriptor (stdout, pipe) or a string in memory.
+ */
+class Sink{
+private:
+    int fd;                     // -1 for memory
+    bool owned;                 // opened here, closed with the sink
+    std::string *memory;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    void write_out(const char *data, size_t size){
+        if (memory){
+            memory->append(data, size);
+            return;
+        }
+        while (size > 0){
+            ssize_t written = write(fd, data, size);
+            if (written < 0){
+                if (errno == EINTR) continue;
+                *diag << "Output error" << std::endl;
+                throw compile_error_t();
+            }
+            data += written;
+            size -= written;
+        }
+    }
 
-    size_t temp;
-    size_t label = 0;           // to maintain labels in assembly code.
-    long int stack_index = -4;  // position on stack frame.
+public:
+    explicit Sink(int descriptor) : fd(descriptor), owned(false), memory(nullptr), buffer(1 << 16){}
 
-    dvar_t decl_vars;       // Local variables are saved on the stack.
-                            // We need to remember exact position of each variable on the stack.
-                            // A map from variable names to locations
-    std::stack<size_t> labels;
-    std::stack<size_t> size_dv;
-    std::vector<AST> functions;
+    explicit Sink(std::string *target) : fd(-1), owned(false), memory(target), buffer(1 << 16){}
 
-    size_dv.push(0);
-    size_t current = 0;
-    while (current < ast.size()){
-        switch (ast[current].check_type()){
-            case FUNC_CALL:
-                fprintf(pfile, "\tcall %s\n", ast[current].check_func_name().c_str());
-                current++;
-                break;
+    // File at path, "-" for stdout.
+    explicit Sink(const std::string& path) : fd(1), owned(false), memory(nullptr), buffer(1 << 16){
+        if (path == "-") return;
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0){
+            *diag << "Can't open output file: " << path << std::endl;
+            throw compile_error_t();
+        }
+        owned = true;
+    }
 
-            case O_BR:
-                size_dv.push(decl_vars.size());
-                current++;
-                break;
+    Sink(const Sink&) = delete;
+    Sink& operator=(const Sink&) = delete;
 
-            case C_BR:
-                while (decl_vars.size() > size_dv.top()){
-                    decl_vars.erase(decl_vars.begin() + decl_vars.size() - 1);
-                }
-                size_dv.pop();
-                current++;
-                break;
+    // Errors are reported by flush(), called by the owner; here what is left is written if it can be.
+    ~Sink(){
+        try {
+            flush();
+        } catch (const compile_error_t&){}
+        if (owned) close(fd);
+    }
 
-            case VARDECL:
-                if (find_var(ast[current].check_var_name(), decl_vars).first != 0 &&
-                    find_var(ast[current].check_var_name(), decl_vars).second >= size_dv.top()){
-                    std::cout << "Variable is already defined" << std::endl;
-                    exit(0);
-                }
-                decl_vars.emplace_back(ast[current].check_var_name(), stack_index);
-                fprintf(pfile, "\tpush 0\n");
-                stack_index -= 4;
-                current++;
-                break;
+    void flush(){
+        size_t size = used;
+        used = 0;
+        write_out(buffer.data(), size);
+    }
 
-            case VARASSIGN:
-                if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
-                    std::cout << "Variable is not defined1" << std::endl;
-                    exit(0);
-                }
-                fprintf(pfile, "\tmov [ebp + %d], eax\n", find_var(ast[current].check_var_name(), decl_vars).first);
-                current++;
-                break;
+    Sink& put(char c){
+        if (used == buffer.size()) flush();
+        buffer[used++] = c;
+        return *this;
+    }
 
-            case VARREF:
-                if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
-                    std::cout << "Variable is not defined2" << std::endl;
-                    exit(0);
-                }
-                fprintf(pfile, "\tmov eax, [ebp + %d]\n", find_var(ast[current].check_var_name(), decl_vars).first);
-                fprintf(pfile, "\tpush eax\n");
-                stack_index -= 4;
-                current++;
-                break;
+    Sink& put(const char *data, size_t size){
+        if (used + size > buffer.size()){
+            flush();
+            if (size > buffer.size()){
+                write_out(data, size);
+                return *this;
+            }
+        }
+        memcpy(buffer.data() + used, data, size);
+        used += size;
+        return *this;
+    }
 
-            case FUNC_DECL:
-                fprintf(pfile, "%s:\n", ast[current].check_func_name().c_str());    // function name.
-                fprintf(pfile, "\tpush ebp\n");     //save old value of EBP
-                fprintf(pfile, "\tmov ebp, esp\n"); //current top of stack is bottom of new stack frame
-                current++;
-                break;
+    Sink& put(const char *text){
+        return put(text, strlen(text));
+    }
 
-            case WHILE_LABEL:
-                fprintf(pfile, "label%zu:\n", label);
-                labels.push(label);
-                current++;
-                label++;
-                break;
+    Sink& put(const std::string& text){
+        return put(text.data(), text.size());
+    }
 
-            case WHILE_EXPR:
-                fprintf(pfile, "\tpop eax\n");
-                stack_index += 4;
-                fprintf(pfile, "\tcmp eax, 0\n");
-                fprintf(pfile, "\tje label%zu\n", label);
-                labels.push(label);
-                current++;
-                label++;
-                break;
+    // Decimal number.
+    Sink& num(long int value){
+        char digits[24];
+        int size = 0;
+        unsigned long magnitude = value < 0 ? 0ul - (unsigned long)value : (unsigned long)value;
+        do {
+            digits[sizeof(digits) - 1 - size++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (value < 0) digits[sizeof(digits) - 1 - size++] = '-';
+        return put(digits + sizeof(digits) - size, size);
+    }
+};
 
-            case WHILE_END:
-                temp = labels.top();
-                labels.pop();
-                fprintf(pfile, "\tjmp label%lu\n", labels.top());
-                labels.pop();
-                fprintf(pfile, "\tlabel%zu:\n", temp);
-                current++;
-                break;
+/*
+ * Assembler.
+ * Code generator gives it instructions, which are either written as text (-S, for debugging)
+ * or encoded into machine code and written as ELF relocatable object with the functions
+ * as global symbols. Jumps to labels are resolved here, calls and jumps to functions
+ * get relocations, so the object links with the system ld.
+ */
+enum ins_list {
+    I_MOV,
+    I_LEA,
+    I_ADD,
+    I_SUB,
+    I_AND,
+    I_CMP,
+    I_TEST,
+    I_IMUL,
+    I_IDIV,
+    I_NEG,
+    I_NOT,
+    I_SHL,
+    I_SAR,
+    I_SHR,
+    I_PUSH,
+    I_POP,
+    I_CDQ,
+    I_JMP,
+    I_CALL,
+    I_RET,
+};
 
-            case NEXT:          // break
-                fprintf(pfile, "\tjmp label%lu\n", labels.top());
-                current++;
-                break;
+// Condition codes, numbered as in the encoding. Negation flips the lowest bit.
+enum cc_list { CC_E = 4, CC_NE = 5, CC_L = 12, CC_GE = 13, CC_LE = 14, CC_G = 15 };
 
-            case SKIP:          // continue
-                temp = labels.top();
-                labels.pop();
-                fprintf(pfile, "\tjmp label%lu\n", labels.top());
-                labels.push(temp);
-                current++;
-                break;
+enum operands_list { OPD_NONE, OPD_REG, OPD_MEM, OPD_IMM, OPD_LABEL, OPD_SYMBOL };
 
-            case COND_QUEST:        // ternary
-                fprintf(pfile, "\tpop eax\n");
-                stack_index += 4;
-                fprintf(pfile, "\tcmp eax, 0\n");
-                fprintf(pfile, "\tje label%zu\n", label);
-                labels.push(label);
-                current++;
-                label++;
-                break;
+struct operand_t {
+    int kind = OPD_NONE;
+    int reg = -1;               // register, or base of memory (-1 if none)
+    int index = -1;             // index of memory
+    int scale = 1;
+    long int value = 0;         // immediate or displacement
+    bool wide = false;          // whole 64-bit register
+    std::string name;           // label or function
+};
 
-            case COND_COLON:        // ternary
-                fprintf(pfile, "\tjmp label%zu\n", label);
-                fprintf(pfile, "\tlabel%lu:\n", labels.top());
-                labels.pop();
-                labels.push(label);
-                label++;
-                current++;
-                break;
+// 32-bit register.
+operand_t reg_opd(int reg);
+// Whole register of the target: pushed, popped or pointing to the stack.
+operand_t wide_opd(int reg);
+operand_t imm_opd(long int value);
+// Memory at reg + index * scale + value, registers are whole.
+operand_t mem_opd(int base, long int disp, int index = -1, int scale = 1);
+operand_t label_opd(const std::string& name);
+operand_t symbol_opd(const std::string& name);
+/*
+ * Code of one function, generated alone and spliced into the output (incremental builds):
+ * text, or machine code with its jumps resolved and its calls left as relocations.
+ */
+struct chunk_t {
+    std::string name;
+    std::string code;
+    std::vector<std::pair<size_t, std::string>> calls;      // rel32 to functions, from the start of code
+};
 
-            case COND_END:          // ternary
-                fprintf(pfile, "\tlabel%lu:\n", labels.top());
-                labels.pop();
-                label++;
-                current++;
-                break;
+class Assembler{
+private:
+    Sink *out;                  // output, nullptr if code runs in memory
+    bool text_mode;
+    std::vector<unsigned char> code;
+    std::map<std::string, size_t> labels;
+    std::vector<std::pair<size_t, std::string>> fixups;     // rel32 to labels
+    std::vector<std::pair<size_t, std::string>> relocs;     // rel32 to functions
+    std::vector<std::pair<std::string, size_t>> functions;  // defined ones, by address
 
-            case IF_ELSE:
-                fprintf(pfile, "\tpop eax\n");
-                stack_index += 4;
-                fprintf(pfile, "\tcmp eax, 0\n");
-                fprintf(pfile, "\tje label%zu\n", label);   // if e1 == 0, e1 is false so execute e3
-                labels.push(label);
-                current++;
-                label++;
-                break;
+public:
+    // Part is code of a function for a chunk, it has no header.
+    Assembler(Sink *output, bool text, bool part = false) : out(output), text_mode(text){
+        if (text_mode && !part) out->put(".intel_syntax noprefix\n");
+    }
 
-            case IF_BODY:
-                fprintf(pfile, "\tjmp label%zu\n", label);      // jump over e3
-                fprintf(pfile, "\tlabel%lu:\n", labels.top());
-                labels.pop();
-                labels.push(label);
-                label++;
-                current++;
-                break;
+    bool text(){
+        return text_mode;
+    }
 
-            case IF_END:
-                fprintf(pfile, "\tlabel%lu:\n", labels.top());  // we need this label to jump over e3
-                labels.pop();
-                label++;
-                current++;
-                break;
+    // Global function starts here.
+    void function(const std::string& name){
+        if (text()){
+            out->put(".globl ").put(name).put('\n').put(name).put(":\n");
+            return;
+        }
+        functions.emplace_back(name, code.size());
+        labels[name] = code.size();
+    }
 
-            case CONSTANT:
-                fprintf(pfile, "\tmov eax, %d\n", ast[current].check_inum());
-                fprintf(pfile, "\tpush eax\n");
-                stack_index -= 4;
-                current++;
-                break;
+    void label(const std::string& name){
+        report.labels++;
+        if (text()){
+            out->put(name).put(":\n");
+            return;
+        }
+        labels[name] = code.size();
+    }
 
-            case RET:
-                fprintf(pfile, "\tmov esp, ebp\n"); //restore ESP; now it points to old EBP
-                fprintf(pfile, "\tpop ebp\n");  // restore old EBP; now ESP is where it was before prologue
-                fprintf(pfile, "\tret\n");
-                current++;
-                break;
+    void ins(int op, const operand_t& a = operand_t(), const operand_t& b = operand_t(), const operand_t& c = operand_t()){
+        report.instructions++;
+        if (text()){
+            print(op, a, b, c);
+        } else {
+            encode(op, a, b, c);
+        }
+    }
 
-            case UN_OP:     // unary operation
-                if (ast[current].check_op() == "-"){
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tneg eax\n");
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
+    void jcc(int cc, const std::string& name){
+        report.instructions++;
+        if (text()){
+            out->put("\tj").put(cc_names[cc]).put(' ').put(name).put('\n');
+            return;
+        }
+        byte(0x0F);
+        byte(0x80 + cc);
+        rel32(fixups, name);
+    }
 
-                /*
-                 * cmp      compares 2 values. cmp a, b -> b-a = 0 -> ZF = 1
-                 * sete     set if equal. sets its operand to 1 if the result of last comparison was equal.
-                 * sete uses ZF to test. ZF = 1 -> set to 1 and vice versa. Can st only a byte, not word.
-                 * Both refer to FLAGS register.
-                 */
-                if (ast[current].check_op() == "!"){
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, 0\n");       // set ZF (zero flag) on if exp == 0, clear otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       // zero out EAX (doesn't change FLAGS)
-                    fprintf(pfile, "\tsete al\n");          // set AL register (the lower byte of EAX) to 1 if ZF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
-                if (ast[current].check_op() == "~"){
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tnot eax\n");
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
+    // AL = 1 if condition holds, else 0; rest of EAX unchanged.
+    void setcc(int cc){
+        report.instructions++;
+        if (text()){
+            out->put("\tset").put(cc_names[cc]).put(" al\n");
+            return;
+        }
+        byte(0x0F);
+        byte(0x90 + cc);
+        byte(0xC0);
+    }
 
-            case BI_OP:     // binary operation
-                if (ast[current].check_op() == "=="){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsete al\n");          //set AL if ZF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
+    // Resolves jumps and writes the object file (text is already written).
+    void finish(){
+        if (text()){
+            out->put(".section .note.GNU-stack,\"\",@progbits\n");     // stack is not executable
+            return;
+        }
+        resolve(fixups, "Undefined label: ");
+        write_elf();
+    }
 
-                if (ast[current].check_op() == "!="){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsetne al\n");          //set AL if ZF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
+    // Resolves jumps and calls too, for code which runs where it is (JIT). All functions must be defined.
+    void link(){
+        resolve(fixups, "Undefined label: ");
+        resolve(relocs, "Function is not defined: ");
+        relocs.clear();
+    }
 
-                if (ast[current].check_op() == "<"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsetl al\n");          //set AL if ZF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
-                }
+    // Ends a part: its machine code goes into the chunk (text is already in the output).
+    void part(chunk_t& chunk){
+        if (text()){
+            out->flush();
+            return;
+        }
+        resolve(fixups, "Undefined label: ");
+        fixups.clear();
+        chunk.code.assign(code.begin(), code.end());
+        chunk.calls = relocs;
+    }
 
-                if (ast[current].check_op() == ">"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsetg al\n");          //set AL if SF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
+    // Function generated by a part, as if it were generated here.
+    void splice(const chunk_t& chunk){
+        if (text()){
+            out->put(chunk.code);
+            return;
+        }
+        size_t start = code.size();
+        functions.emplace_back(chunk.name, start);
+        labels[chunk.name] = start;
+        for (const auto& call : chunk.calls){
+            relocs.emplace_back(start + call.first, call.second);
+        }
+        code.insert(code.end(), chunk.code.begin(), chunk.code.end());
+    }
+
+    const std::vector<unsigned char>& machine_code(){
+        return code;
+    }
+
+    // Defined functions and their offsets, in order of the code.
+    const std::vector<std::pair<std::string, size_t>>& symbols(){
+        return functions;
+    }
+
+    static const char *cc_names[16];
+
+private:
+    static const char *mnemonic(int op){
+        const char *names[] = {"mov", "lea", "add", "sub", "and", "cmp", "test", "imul", "idiv", "neg",
+                               "not", "shl", "sar", "shr", "push", "pop", "cdq", "jmp", "call", "ret"};
+        return names[op];
+    }
+
+    static const char *reg_name(int reg, bool wide){
+        const char *names32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                 "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+        const char *names64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                 "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+        return wide ? names64[reg] : names32[reg];
+    }
+
+    void print_operand(int op, const operand_t& opd){
+        switch (opd.kind){
+            case OPD_REG:
+                out->put(reg_name(opd.reg, opd.wide));
+                break;
+            case OPD_IMM:
+                out->num(opd.value);
+                break;
+            case OPD_LABEL:
+            case OPD_SYMBOL:
+                out->put(opd.name);
+                break;
+            case OPD_MEM:
+                out->put(op == I_LEA ? "[" : "dword ptr [");
+                if (opd.reg >= 0) out->put(reg_name(opd.reg, x86_64));
+                if (opd.index >= 0){
+                    if (opd.reg >= 0) out->put(" + ");
+                    out->put(reg_name(opd.index, x86_64)).put('*').num(opd.scale);
+                }
+                out->put(" + ").num(opd.value).put(']');
+                break;
+        }
+    }
+
+    void print(int op, const operand_t& a, const operand_t& b, const operand_t& c){
+        out->put('\t').put(mnemonic(op));
+        const operand_t *operands[] = {&a, &b, &c};
+        for (int k = 0; k < 3 && operands[k]->kind != OPD_NONE; k++){
+            out->put(k == 0 ? " " : ", ");
+            print_operand(op, *operands[k]);
+        }
+        out->put('\n');
+    }
+
+    void byte(unsigned value){
+        code.push_back((unsigned char)value);
+    }
+
+    void imm32(long int value){
+        for (int k = 0; k < 4; k++){
+            byte((unsigned long)value >> (8 * k));
+        }
+    }
+
+    void put32(size_t pos, uint32_t value){
+        for (int k = 0; k < 4; k++){
+            code[pos + k] = (unsigned char)(value >> (8 * k));
+        }
+    }
+
+    void rel32(std::vector<std::pair<size_t, std::string>>& list, const std::string& name){
+        list.emplace_back(code.size(), name);
+        imm32(0);
+    }
+
+    void resolve(const std::vector<std::pair<size_t, std::string>>& list, const char *error){
+        for (const auto& fixup : list){
+            if (labels.find(fixup.second) == labels.end()){
+                *diag << error << fixup.second << std::endl;
+                throw compile_error_t();
+            }
+            put32(fixup.first, (uint32_t)(labels[fixup.second] - (fixup.first + 4)));
+        }
+    }
+
+    static bool fits8(long int value){
+        return value >= -128 && value <= 127;
+    }
+
+    // REX prefix: 64-bit operand (w) and high registers in ModRM reg field, index and base.
+    void rex(bool w, int reg, const operand_t& rm){
+        int index = rm.kind == OPD_MEM ? rm.index : -1;
+        int base = rm.reg;
+        unsigned value = 0x40 | (w ? 8 : 0) | (reg >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) | (base >= 8 ? 1 : 0);
+        if (value != 0x40) byte(value);
+    }
+
+    // ModRM byte, with SIB and displacement for memory.
+    void modrm(int reg, const operand_t& rm){
+        reg &= 7;
+        if (rm.kind == OPD_REG){
+            byte(0xC0 | (reg << 3) | (rm.reg & 7));
+            return;
+        }
+        if (rm.reg < 0){                                    // no base: index * scale + disp32
+            byte(0x04 | (reg << 3));
+            byte((scale_bits(rm.scale) << 6) | ((rm.index & 7) << 3) | 5);
+            imm32(rm.value);
+            return;
+        }
+        int mod = rm.value == 0 && (rm.reg & 7) != EBP ? 0 : fits8(rm.value) ? 1 : 2;
+        if (rm.index >= 0 || (rm.reg & 7) == ESP){         // SIB, index 100 is none
+            byte((mod << 6) | (reg << 3) | 4);
+            int index = rm.index >= 0 ? (rm.index & 7) : 4;
+            byte((scale_bits(rm.scale) << 6) | (index << 3) | (rm.reg & 7));
+        } else {
+            byte((mod << 6) | (reg << 3) | (rm.reg & 7));
+        }
+        if (mod == 1) byte(rm.value);
+        if (mod == 2) imm32(rm.value);
+    }
+
+    static int scale_bits(int scale){
+        return scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+    }
+
+    // Instruction with ModRM: prefix, opcode bytes, operand.
+    void op_rm(std::initializer_list<unsigned> opcode, int reg, const operand_t& rm, bool w){
+        rex(w && x86_64, reg, rm);
+        for (unsigned value : opcode) byte(value);
+        modrm(reg, rm);
+    }
+
+    void encode(int op, const operand_t& a, const operand_t& b, const operand_t& c){
+        bool w = a.kind == OPD_REG && a.wide;
+        int alu = op == I_ADD ? 0 : op == I_AND ? 4 : op == I_SUB ? 5 : 7;     // /digit of 81 and 83
+        switch (op){
+            case I_MOV:
+                if (a.kind == OPD_REG && b.kind == OPD_IMM){
+                    rex(false, 0, a);
+                    byte(0xB8 + (a.reg & 7));
+                    imm32(b.value);
+                } else if (b.kind == OPD_IMM){
+                    op_rm({0xC7}, 0, a, false);
+                    imm32(b.value);
+                } else if (b.kind == OPD_REG){
+                    op_rm({0x89}, b.reg, a, w);
+                } else {
+                    op_rm({0x8B}, a.reg, b, w);
+                }
+                break;
+
+            case I_LEA:
+                op_rm({0x8D}, a.reg, b, w);
+                break;
+
+            case I_ADD:
+            case I_SUB:
+            case I_AND:
+            case I_CMP:
+                if (b.kind == OPD_IMM){
+                    op_rm({fits8(b.value) ? 0x83u : 0x81u}, alu, a, w);
+                    if (fits8(b.value)) byte(b.value); else imm32(b.value);
+                } else if (b.kind == OPD_REG){
+                    op_rm({(unsigned)(alu << 3) + 1}, b.reg, a, w);
+                } else {
+                    op_rm({(unsigned)(alu << 3) + 3}, a.reg, b, w);
+                }
+                break;
+
+            case I_TEST:
+                op_rm({0x85}, b.reg, a, false);
+                break;
+
+            case I_IMUL:
+                if (b.kind == OPD_NONE){
+                    op_rm({0xF7}, 5, a, false);                 // EDX:EAX = EAX * a
+                } else if (c.kind == OPD_IMM){
+                    op_rm({fits8(c.value) ? 0x6Bu : 0x69u}, a.reg, b, false);
+                    if (fits8(c.value)) byte(c.value); else imm32(c.value);
+                } else {
+                    op_rm({0x0F, 0xAF}, a.reg, b, false);
+                }
+                break;
+
+            case I_IDIV:
+                op_rm({0xF7}, 7, a, false);
+                break;
+
+            case I_NEG:
+                op_rm({0xF7}, 3, a, false);
+                break;
+
+            case I_NOT:
+                op_rm({0xF7}, 2, a, false);
+                break;
+
+            case I_SHL:
+            case I_SAR:
+            case I_SHR:
+                op_rm({0xC1}, op == I_SHL ? 4 : op == I_SAR ? 7 : 5, a, false);
+                byte(b.value);
+                break;
+
+            case I_PUSH:
+            case I_POP:
+                rex(false, 0, a);
+                byte((op == I_PUSH ? 0x50 : 0x58) + (a.reg & 7));
+                break;
+
+            case I_CDQ:
+                byte(0x99);
+                break;
+
+            case I_JMP:
+                byte(0xE9);
+                rel32(a.kind == OPD_SYMBOL ? relocs : fixups, a.name);
+                break;
+
+            case I_CALL:
+                byte(0xE8);
+                rel32(relocs, a.name);
+                break;
+
+            case I_RET:
+                byte(0xC3);
+                break;
+        }
+    }
+
+    // Little-endian fields of ELF structures.
+    static void put(std::vector<unsigned char>& out, uint64_t value, int size){
+        for (int k = 0; k < size; k++){
+            out.push_back((unsigned char)(value >> (8 * k)));
+        }
+    }
+
+    static size_t add_string(std::vector<unsigned char>& table, const std::string& name){
+        size_t offset = table.size();
+        table.insert(table.end(), name.begin(), name.end());
+        table.push_back(0);
+        return offset;
+    }
+
+    /*
+     * Sections: null, .text, .rel.text (.rela.text on x86-64), .symtab, .strtab, .shstrtab, .note.GNU-stack.
+     * Symbols: null, then global functions, defined ones first, then those only called.
+     */
+    void write_elf(){
+        const int addr = x86_64 ? 8 : 4;           // size of address fields
+        std::vector<unsigned char> strtab(1, 0), shstrtab(1, 0), symtab, rel;
+
+        std::vector<std::string> symbols;
+        for (const auto& func : functions){
+            symbols.emplace_back(func.first);
+        }
+        for (const auto& reloc : relocs){
+            if (!find_str_vec(reloc.second, symbols)) symbols.emplace_back(reloc.second);
+        }
+        put(symtab, 0, x86_64 ? 24 : 16);
+        for (size_t k = 0; k < symbols.size(); k++){
+            size_t name = add_string(strtab, symbols[k]);
+            bool defined = k < functions.size();
+            uint64_t value = defined ? functions[k].second : 0;
+            uint64_t size = !defined ? 0 : k + 1 < functions.size() ? functions[k + 1].second - value : code.size() - value;
+            unsigned info = defined ? 0x12 : 0x10;     // global, function or no type
+            unsigned section = defined ? 1 : 0;
+            put(symtab, name, 4);
+            if (x86_64){
+                put(symtab, info, 1);
+                put(symtab, 0, 1);
+                put(symtab, section, 2);
+                put(symtab, value, 8);
+                put(symtab, size, 8);
+            } else {
+                put(symtab, value, 4);
+                put(symtab, size, 4);
+                put(symtab, info, 1);
+                put(symtab, 0, 1);
+                put(symtab, section, 2);
+            }
+        }
+        for (const auto& reloc : relocs){
+            uint64_t symbol = std::find(symbols.begin(), symbols.end(), reloc.second) - symbols.begin() + 1;
+            if (x86_64){
+                put(rel, reloc.first, 8);
+                put(rel, (symbol << 32) | 4, 8);        // R_X86_64_PLT32
+                put(rel, (uint64_t)-4, 8);              // addend: from end of the field
+            } else {
+                put(rel, reloc.first, 4);
+                put(rel, (symbol << 8) | 2, 4);         // R_386_PC32, addend -4 is in the field
+                put32(reloc.first, (uint32_t)-4);
+            }
+        }
+
+        struct section_t {
+            size_t name;
+            unsigned type;
+            unsigned flags;
+            const std::vector<unsigned char>* data;
+            unsigned link;
+            unsigned info;
+            unsigned align;
+            unsigned entsize;
+        };
+        std::vector<unsigned char> empty;
+        std::vector<section_t> sections = {
+            {0, 0, 0, &empty, 0, 0, 0, 0},
+            {add_string(shstrtab, ".text"), 1, 0x6, &code, 0, 0, 16, 0},
+            {add_string(shstrtab, x86_64 ? ".rela.text" : ".rel.text"), x86_64 ? 4u : 9u, 0x40, &rel, 3, 1,
+             (unsigned)addr, x86_64 ? 24u : 8u},
+            {add_string(shstrtab, ".symtab"), 2, 0, &symtab, 4, 1, (unsigned)addr, x86_64 ? 24u : 16u},
+            {add_string(shstrtab, ".strtab"), 3, 0, &strtab, 0, 0, 1, 0},
+            {0, 3, 0, &shstrtab, 0, 0, 1, 0},
+            {add_string(shstrtab, ".note.GNU-stack"), 1, 0, &empty, 0, 0, 1, 0},
+        };
+        sections[5].name = add_string(shstrtab, ".shstrtab");
+
+        std::vector<unsigned char> file;
+        size_t header = x86_64 ? 64 : 52;
+        std::vector<size_t> offsets;
+        size_t offset = header;
+        for (const section_t& section : sections){
+            offset = (offset + 15) / 16 * 16;
+            offsets.push_back(offset);
+            offset += section.data->size();
+        }
+        size_t shoff = (offset + 15) / 16 * 16;
+
+        const unsigned char ident[] = {0x7F, 'E', 'L', 'F', (unsigned char)(x86_64 ? 2 : 1), 1, 1, 0};
+        file.insert(file.end(), ident, ident + 8);
+        put(file, 0, 8);
+        put(file, 1, 2);                             // relocatable
+        put(file, x86_64 ? 62 : 3, 2);               // machine
+        put(file, 1, 4);
+        put(file, 0, addr);                          // entry
+        put(file, 0, addr);                          // program headers
+        put(file, shoff, addr);
+        put(file, 0, 4);
+        put(file, header, 2);
+        put(file, 0, 2);
+        put(file, 0, 2);
+        put(file, x86_64 ? 64 : 40, 2);              // section header size
+        put(file, sections.size(), 2);
+        put(file, 5, 2);                             // .shstrtab
+
+        for (size_t k = 0; k < sections.size(); k++){
+            file.resize(offsets[k], 0);
+            file.insert(file.end(), sections[k].data->begin(), sections[k].data->end());
+        }
+        file.resize(shoff, 0);
+        for (size_t k = 0; k < sections.size(); k++){
+            const section_t& section = sections[k];
+            put(file, section.name, 4);
+            put(file, section.type, 4);
+            put(file, section.flags, addr);
+            put(file, 0, addr);
+            put(file, k == 0 ? 0 : offsets[k], addr);
+            put(file, section.data->size(), addr);
+            put(file, section.link, 4);
+            put(file, section.info, 4);
+            put(file, section.align, addr);
+            put(file, section.entsize, addr);
+        }
+
+        out->put((const char *)file.data(), file.size());
+    }
+};
+
+const char *Assembler::cc_names[16] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+                                       "s", "ns", "p", "np", "l", "ge", "le", "g"};
+
+/*
+ * Instruction selection for expressions (bottom-up rewriting).
+ * Expression trees are matched against the rules below. Each rule derives a nonterminal,
+ * a place where the value of the tree is, from an operator and nonterminals of its operands.
+ * Cheapest derivation of every nonterminal is found bottom up, then code is emitted top down.
+ */
+enum sel_op_t {
+    SEL_CONST,
+    SEL_VAR,
+    SEL_STACK,      // value the code before the tree pushed
+    SEL_NEG,
+    SEL_NOT,
+    SEL_BITNOT,
+    SEL_ADD,
+    SEL_SUB,
+    SEL_MUL,
+    SEL_DIV,
+    SEL_EQ,
+    SEL_NE,
+    SEL_LT,
+    SEL_GT,
+    SEL_LE,
+    SEL_GE,
+    SEL_CMP,        // in rules: any comparison
+    SEL_ADDSUB,     // in rules: + or -
+    SEL_CHAIN,      // in rules: derived from another nonterminal of the same node
+};
+
+enum sel_nt_t {
+    NT_REG,         // computed into EAX
+    NT_IMM,         // constant, immediate operand
+    NT_RM,          // variable, register or memory operand
+    NT_VREG,        // variable in register
+    NT_ADDR,        // variables in registers (one of them scaled) plus constant, lea operand
+    NT_CC,          // comparison, in flags
+    NT_NUM,
+};
+
+enum sel_action_t {
+    A_OPERAND,      // no code, operand of the parent
+    A_POP,
+    A_MOV,
+    A_LEA,
+    A_SETCC,
+    A_TEST_REG,
+    A_NEG,
+    A_BITNOT,
+    A_ALU_RX,       // op eax, operand
+    A_ALU_XR,       // commutative, operand on the left
+    A_SUB_XR,
+    A_MUL_IMM,
+    A_DIV_IMM,
+    A_DIV_RX,
+    A_BIN,          // both operands computed
+    A_BIN_XR,
+    A_CMP_RX,
+    A_CMP_XI,
+    A_CMP_VX,
+    A_CMP_XR,
+    A_CMP_IR,
+    A_CMP,
+    A_TEST,
+    A_NOT,
+    A_NOT_CC,
+};
+
+struct sel_rule_t {
+    int nt;             // derived nonterminal
+    int op;             // operator of the node
+    int left;           // nonterminals of operands, or of the node for SEL_CHAIN
+    int right;
+    int cost;           // roughly, in cycles
+    int action;
+};
+
+const sel_rule_t sel_rules[] = {
+    {NT_IMM,  SEL_CONST,  -1,      -1,      0,  A_OPERAND},
+    {NT_IMM,  SEL_NEG,    NT_IMM,  -1,      0,  A_OPERAND},
+    {NT_RM,   SEL_VAR,    -1,      -1,      0,  A_OPERAND},
+    {NT_VREG, SEL_VAR,    -1,      -1,      0,  A_OPERAND},
+    {NT_ADDR, SEL_VAR,    -1,      -1,      0,  A_OPERAND},
+    {NT_ADDR, SEL_ADD,    NT_ADDR, NT_ADDR, 0,  A_OPERAND},
+    {NT_ADDR, SEL_ADD,    NT_ADDR, NT_IMM,  0,  A_OPERAND},
+    {NT_ADDR, SEL_ADD,    NT_IMM,  NT_ADDR, 0,  A_OPERAND},
+    {NT_ADDR, SEL_SUB,    NT_ADDR, NT_IMM,  0,  A_OPERAND},
+    {NT_ADDR, SEL_MUL,    NT_VREG, NT_IMM,  0,  A_OPERAND},
+    {NT_ADDR, SEL_MUL,    NT_IMM,  NT_VREG, 0,  A_OPERAND},
+
+    {NT_REG,  SEL_STACK,  -1,      -1,      1,  A_POP},
+    {NT_REG,  SEL_NEG,    NT_REG,  -1,      1,  A_NEG},
+    {NT_REG,  SEL_BITNOT, NT_REG,  -1,      1,  A_BITNOT},
+    {NT_REG,  SEL_ADDSUB, NT_REG,  NT_IMM,  1,  A_ALU_RX},
+    {NT_REG,  SEL_ADDSUB, NT_REG,  NT_RM,   1,  A_ALU_RX},
+    {NT_REG,  SEL_ADD,    NT_IMM,  NT_REG,  1,  A_ALU_XR},
+    {NT_REG,  SEL_ADD,    NT_RM,   NT_REG,  1,  A_ALU_XR},
+    {NT_REG,  SEL_SUB,    NT_IMM,  NT_REG,  2,  A_SUB_XR},
+    {NT_REG,  SEL_SUB,    NT_RM,   NT_REG,  2,  A_SUB_XR},
+    {NT_REG,  SEL_ADDSUB, NT_REG,  NT_REG,  4,  A_BIN},
+    {NT_REG,  SEL_MUL,    NT_REG,  NT_IMM,  2,  A_MUL_IMM},
+    {NT_REG,  SEL_MUL,    NT_IMM,  NT_REG,  2,  A_MUL_IMM},
+    {NT_REG,  SEL_MUL,    NT_REG,  NT_RM,   3,  A_ALU_RX},
+    {NT_REG,  SEL_MUL,    NT_RM,   NT_REG,  3,  A_ALU_XR},
+    {NT_REG,  SEL_MUL,    NT_REG,  NT_REG,  6,  A_BIN},
+    {NT_REG,  SEL_DIV,    NT_REG,  NT_IMM,  5,  A_DIV_IMM},
+    {NT_REG,  SEL_DIV,    NT_REG,  NT_RM,   21, A_DIV_RX},
+    {NT_REG,  SEL_DIV,    NT_RM,   NT_REG,  23, A_BIN_XR},
+    {NT_REG,  SEL_DIV,    NT_REG,  NT_REG,  24, A_BIN},
+
+    {NT_CC,   SEL_CMP,    NT_REG,  NT_IMM,  1,  A_TEST},        // before cmp, when constant is 0
+    {NT_CC,   SEL_CMP,    NT_VREG, NT_IMM,  1,  A_TEST},
+    {NT_CC,   SEL_CMP,    NT_REG,  NT_IMM,  1,  A_CMP_RX},
+    {NT_CC,   SEL_CMP,    NT_REG,  NT_RM,   1,  A_CMP_RX},
+    {NT_CC,   SEL_CMP,    NT_RM,   NT_IMM,  1,  A_CMP_XI},
+    {NT_CC,   SEL_CMP,    NT_VREG, NT_RM,   1,  A_CMP_VX},
+    {NT_CC,   SEL_CMP,    NT_RM,   NT_REG,  1,  A_CMP_XR},
+    {NT_CC,   SEL_CMP,    NT_IMM,  NT_REG,  1,  A_CMP_IR},
+    {NT_CC,   SEL_CMP,    NT_REG,  NT_REG,  4,  A_CMP},
+    {NT_CC,   SEL_NOT,    NT_CC,   -1,      0,  A_NOT_CC},
+    {NT_CC,   SEL_NOT,    NT_REG,  -1,      1,  A_NOT},
+
+    {NT_REG,  SEL_CHAIN,  NT_IMM,  -1,      1,  A_MOV},
+    {NT_REG,  SEL_CHAIN,  NT_RM,   -1,      1,  A_MOV},
+    {NT_REG,  SEL_CHAIN,  NT_ADDR, -1,      1,  A_LEA},
+    {NT_REG,  SEL_CHAIN,  NT_CC,   -1,      2,  A_SETCC},
+    {NT_CC,   SEL_CHAIN,  NT_REG,  -1,      1,  A_TEST_REG},
+};
+const int sel_rules_num = sizeof(sel_rules) / sizeof(sel_rules[0]);
+
+// Operators of AST nodes, with their instruction or condition code.
+struct sel_opcode_t {
+    int type;
+    const char *op;
+    int sel_op;
+    int code;
+};
+
+const sel_opcode_t sel_opcodes[] = {
+    {UN_OP, "-",  SEL_NEG,    I_NEG},
+    {UN_OP, "!",  SEL_NOT,    CC_E},
+    {UN_OP, "~",  SEL_BITNOT, I_NOT},
+    {BI_OP, "+",  SEL_ADD,    I_ADD},
+    {BI_OP, "-",  SEL_SUB,    I_SUB},
+    {BI_OP, "*",  SEL_MUL,    I_IMUL},
+    {BI_OP, "/",  SEL_DIV,    I_IDIV},
+    {BI_OP, "==", SEL_EQ,     CC_E},
+    {BI_OP, "!=", SEL_NE,     CC_NE},
+    {BI_OP, "<",  SEL_LT,     CC_L},
+    {BI_OP, ">",  SEL_GT,     CC_G},
+    {BI_OP, "<=", SEL_LE,     CC_LE},
+    {BI_OP, ">=", SEL_GE,     CC_GE},
+};
+
+// Operand of lea: base + index * scale + disp.
+struct sel_addr_t {
+    int base;           // var_regs, -1 if none
+    int index;
+    int scale;
+    int disp;
+};
+
+struct sel_node_t {
+    int op;
+    int code;           // instruction or condition code
+    int value;          // constant
+    int reg;            // variable: register or else offset in the frame
+    long int offset;
+    int left;           // operands, -1 if none
+    int right;
+    bool stack;         // has SEL_STACK leaves
+    bool addr_ok;       // address is valid
+    sel_addr_t addr;
+    int cost[NT_NUM];
+    int rule[NT_NUM];
+};
+
+class Selector{
+private:
+    Assembler& as;
+    long int& stack_index;
+    std::function<operand_t(long int)> frame;
+    std::vector<sel_node_t> nodes;
+    std::vector<int> roots;     // trees not used by others yet, bottom of the stack first
+    unsigned in_regs = 0;       // arguments of the next call put into their registers
+
+public:
+    Selector(Assembler& assembler, long int& index, std::function<operand_t(long int)> frame_operand)
+        : as(assembler), stack_index(index), frame(frame_operand){}
+
+    /*
+     * Selects code of expression nodes starting at ast[current], up to the first node of another type.
+     * Values are pushed, except the last one if its consumer is a jump (then it is left in flags)
+     * or an assignment (then it is stored and the assignment is skipped), and arguments
+     * passed in registers if it is a call.
+     * Returns index of the next node.
+     */
+    size_t select(std::vector<AST>& ast, size_t current, const dvar_t& decl_vars, int& flags){
+        nodes.clear();
+        roots.clear();
+        while (current < ast.size() && add_node(ast, current, decl_vars)){
+            current++;
+        }
+
+        label_all();
+        int type = current < ast.size() ? ast[current].check_type() : -1;
+        if (type == FUNC_CALL && ast[current].check_reg() > 0){
+            arguments(ast[current].check_reg());
+            return current;
+        }
+        for (size_t k = 0; k + 1 < roots.size(); k++){
+            emit(roots[k], NT_REG);
+            push();
+        }
+        int root = roots.back();
+        if (type == WHILE_EXPR || type == IF_ELSE || type == COND_QUEST || type == SHORT_CIRC ||
+            (type == BI_OP && (ast[current].check_op() == "&&" || ast[current].check_op() == "||"))){
+            flags = emit(root, NT_CC);
+            return current;
+        }
+        if (type == RET){
+            emit(root, NT_REG);         // returned in EAX
+            return current;
+        }
+        if (type == VARASSIGN){
+            if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
+                *diag << "Variable is not defined1" << std::endl;
+                throw compile_error_t();
+            }
+            operand_t value = imm_opd(nodes[root].value);
+            if (nodes[root].cost[NT_IMM] != 0){
+                emit(root, NT_REG);
+                value = reg_opd(EAX);
+            }
+            if (ast[current].check_reg() >= 0){
+                as.ins(I_MOV, reg_opd(var_regs[ast[current].check_reg()]), value);
+            } else {
+                as.ins(I_MOV, frame(find_var(ast[current].check_var_name(), decl_vars).first), value);
+            }
+            return current + 1;
+        }
+        emit(root, NT_REG);
+        push();
+        return current;
+    }
+
+    // Arguments put into their registers by the last select (bit of each), taken by the call.
+    unsigned args_in_regs(){
+        unsigned result = in_regs;
+        in_regs = 0;
+        return result;
+    }
+
+private:
+    void push(){
+        as.ins(I_PUSH, wide_opd(EAX));
+        stack_index -= word;
+    }
+
+    /*
+     * Arguments of a call: the last trees are its first arguments, regs of them go in registers.
+     * Other trees are selected first, those for registers other than EAX, ECX and EDX (which
+     * their code uses) are moved there. Of the rest the last one stays in EAX, the ones before it
+     * are pushed. Constants, variables and addresses are then moved or lea'd straight into theirs.
+     */
+    void arguments(int regs){
+        size_t first = roots.size() - std::min(roots.size(), (size_t)regs);
+        auto simple = [&](size_t k){
+            const sel_node_t& node = nodes[roots[k]];
+            return k >= first && (node.cost[NT_IMM] == 0 || node.op == SEL_VAR || node.addr_ok);
+        };
+        auto scratch = [&](size_t k){
+            int reg = arg_regs[roots.size() - 1 - k];
+            return k < first || reg == EAX || reg == ECX || reg == EDX;
+        };
+        auto put = [&](size_t k, int ins, const operand_t& value){
+            int arg = roots.size() - 1 - k;
+            as.ins(ins, reg_opd(arg_regs[arg]), value);
+            in_regs |= 1u << arg;
+        };
+
+        for (size_t k = first; k < roots.size(); k++){
+            if (simple(k) || scratch(k)) continue;
+            emit(roots[k], NT_REG);
+            put(k, I_MOV, reg_opd(EAX));
+        }
+        size_t last = roots.size();
+        for (size_t k = 0; k < roots.size(); k++){
+            if (k >= first && !simple(k) && scratch(k)) last = k;
+        }
+        for (size_t k = 0; k < roots.size(); k++){
+            if (simple(k) || !scratch(k)) continue;
+            emit(roots[k], NT_REG);
+            if (k != last) push();
+        }
+        for (size_t k = first; k < roots.size(); k++){
+            if (!simple(k)) continue;
+            const sel_node_t& node = nodes[roots[k]];
+            if (node.cost[NT_IMM] == 0){
+                put(k, I_MOV, imm_opd(node.value));
+            } else if (node.op == SEL_VAR){
+                put(k, I_MOV, rm(roots[k]));
+            } else {
+                put(k, I_LEA, lea_operand(node.addr));
+            }
+        }
+        if (last < roots.size()) put(last, I_MOV, reg_opd(EAX));
+    }
+
+    void pop(int reg){
+        as.ins(I_POP, wide_opd(reg));
+        stack_index += word;
+    }
+
+    int new_node(int op, int left, int right){
+        sel_node_t node;
+        node.op = op;
+        node.code = -1;
+        node.value = 0;
+        node.reg = -1;
+        node.offset = 0;
+        node.left = left;
+        node.right = right;
+        node.stack = op == SEL_STACK || (left >= 0 && nodes[left].stack) || (right >= 0 && nodes[right].stack);
+        node.addr_ok = false;
+        std::fill(node.cost, node.cost + NT_NUM, INT_MAX);
+        std::fill(node.rule, node.rule + NT_NUM, -1);
+        nodes.emplace_back(node);
+        return nodes.size() - 1;
+    }
+
+    // Operand of the next operator: last tree, or value on the stack if there are no trees left.
+    int operand(){
+        if (roots.empty()) return new_node(SEL_STACK, -1, -1);
+        int root = roots.back();
+        roots.pop_back();
+        return root;
+    }
+
+    // Adds ast[current] to the trees, false if it is not part of an expression.
+    bool add_node(std::vector<AST>& ast, size_t current, const dvar_t& decl_vars){
+        switch (ast[current].check_type()){
+            case CONSTANT:
+                roots.emplace_back(new_node(SEL_CONST, -1, -1));
+                nodes.back().value = ast[current].check_inum();
+                return true;
+
+            case VARREF:
+                if (current + 1 < ast.size() && ast[current + 1].check_type() == EXPR_END) return false;
+                if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
+                    *diag << "Variable is not defined2" << std::endl;
+                    throw compile_error_t();
+                }
+                roots.emplace_back(new_node(SEL_VAR, -1, -1));
+                nodes.back().reg = ast[current].check_reg();
+                nodes.back().offset = find_var(ast[current].check_var_name(), decl_vars).first;
+                return true;
+
+            case UN_OP:
+            case BI_OP:
+                for (const sel_opcode_t& opcode : sel_opcodes){
+                    if (opcode.type != ast[current].check_type() || ast[current].check_op() != opcode.op) continue;
+                    int right = operand();
+                    int left = opcode.type == BI_OP ? operand() : -1;
+                    if (left < 0) std::swap(left, right);
+                    roots.emplace_back(new_node(opcode.sel_op, left, right));
+                    nodes.back().code = opcode.code;
+                    return true;
+                }
+                if (ast[current].check_op() == "&&" || ast[current].check_op() == "||") return false;
+                *diag << "Code generation ERROR";
+                throw compile_error_t();
+
+            default:
+                return false;
+        }
+    }
+
+    static bool matches(int rule_op, int op){
+        if (rule_op == SEL_CMP) return op >= SEL_EQ && op <= SEL_GE;
+        if (rule_op == SEL_ADDSUB) return op == SEL_ADD || op == SEL_SUB;
+        return rule_op == op;
+    }
+
+    // Address computed by node, if lea can do it.
+    void address(sel_node_t& node){
+        auto imm = [&](int n){ return n >= 0 && nodes[n].cost[NT_IMM] == 0; };
+        auto addr = [&](int n){ return n >= 0 && nodes[n].addr_ok; };
+        node.addr = {-1, -1, 1, 0};
+        if (node.op == SEL_VAR){
+            node.addr.base = node.reg;
+            node.addr_ok = node.reg >= 0;
+        } else if ((node.op == SEL_ADD || node.op == SEL_SUB) && addr(node.left) && imm(node.right)){
+            node.addr = nodes[node.left].addr;
+            int value = nodes[node.right].value;
+            node.addr.disp = (int)((unsigned)node.addr.disp + (node.op == SEL_ADD ? (unsigned)value : 0u - (unsigned)value));
+            node.addr_ok = true;
+        } else if (node.op == SEL_ADD && imm(node.left) && addr(node.right)){
+            node.addr = nodes[node.right].addr;
+            node.addr.disp = (int)((unsigned)node.addr.disp + (unsigned)nodes[node.left].value);
+            node.addr_ok = true;
+        } else if (node.op == SEL_ADD && addr(node.left) && addr(node.right)){
+            // Registers of both sides, at most two and only one of them scaled.
+            std::vector<std::pair<int, int>> regs;
+            for (const sel_addr_t& side : {nodes[node.left].addr, nodes[node.right].addr}){
+                if (side.base >= 0) regs.emplace_back(side.base, 1);
+                if (side.index >= 0) regs.emplace_back(side.index, side.scale);
+            }
+            if (regs.size() != 2 || (regs[0].second > 1 && regs[1].second > 1)) return;
+            if (regs[0].second > 1) std::swap(regs[0], regs[1]);
+            node.addr = {regs[0].first, regs[1].first, regs[1].second,
+                         (int)((unsigned)nodes[node.left].addr.disp + (unsigned)nodes[node.right].addr.disp)};
+            node.addr_ok = true;
+        } else if (node.op == SEL_MUL){
+            int var = imm(node.right) ? node.left : node.right;
+            int value = imm(node.right) ? nodes[node.right].value : imm(node.left) ? nodes[node.left].value : 0;
+            if (nodes[var].op != SEL_VAR || nodes[var].reg < 0) return;
+            if (value == 2 || value == 4 || value == 8){
+                node.addr = {-1, nodes[var].reg, value, 0};
+                node.addr_ok = true;
+            } else if (value == 3 || value == 5 || value == 9){
+                node.addr = {nodes[var].reg, nodes[var].reg, value - 1, 0};
+                node.addr_ok = true;
+            }
+        }
+    }
+
+    // Extra conditions of rules.
+    bool fits(const sel_rule_t& rule, const sel_node_t& node){
+        if (rule.nt == NT_ADDR) return node.addr_ok;
+        if (rule.nt == NT_VREG) return node.reg >= 0;
+        if (rule.action == A_TEST) return nodes[node.right].value == 0;     // same flags as cmp with 0
+        return true;
+    }
+
+    // Cheapest rule for each nonterminal of each node; operands come before operators.
+    void label_all(){
+        for (sel_node_t& node : nodes){
+            if (node.op == SEL_CONST){
+                node.cost[NT_IMM] = 0;
+            }
+            if (node.op == SEL_NEG && nodes[node.left].cost[NT_IMM] == 0){
+                node.value = (int)(0u - (unsigned)nodes[node.left].value);
+            }
+            address(node);
+            for (int r = 0; r < sel_rules_num; r++){
+                const sel_rule_t& rule = sel_rules[r];
+                if (rule.op == SEL_CHAIN || !matches(rule.op, node.op) || !fits(rule, node)) continue;
+                long int cost = rule.cost;
+                if (rule.left >= 0) cost += nodes[node.left].cost[rule.left];
+                if (rule.right >= 0) cost += nodes[node.right].cost[rule.right];
+                if (cost < node.cost[rule.nt]){
+                    node.cost[rule.nt] = cost;
+                    node.rule[rule.nt] = r;
+                }
+            }
+            bool changed = true;
+            while (changed){
+                changed = false;
+                for (int r = 0; r < sel_rules_num; r++){
+                    const sel_rule_t& rule = sel_rules[r];
+                    if (rule.op != SEL_CHAIN) continue;
+                    long int cost = (long int)rule.cost + node.cost[rule.left];
+                    if (cost < node.cost[rule.nt]){
+                        node.cost[rule.nt] = cost;
+                        node.rule[rule.nt] = r;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Register or memory operand of variable.
+    operand_t rm(int n){
+        if (nodes[n].reg >= 0) return reg_opd(var_regs[nodes[n].reg]);
+        return frame(nodes[n].offset);
+    }
+
+    // Operand derived as nonterminal nt.
+    operand_t operand(int n, int nt){
+        if (nt == NT_IMM) return imm_opd(nodes[n].value);
+        return rm(n);
+    }
+
+    operand_t lea_operand(const sel_addr_t& addr){
+        return mem_opd(addr.base >= 0 ? var_regs[addr.base] : -1, addr.disp,
+                       addr.index >= 0 ? var_regs[addr.index] : -1, addr.scale);
+    }
+
+    // Both operands computed: left one into EAX and right one into ECX.
+    void operands(int left, int right){
+        if (nodes[left].op == SEL_STACK || nodes[left].cost[NT_RM] == 0){
+            emit(right, NT_REG);                // left is below anything right takes from the stack
+            as.ins(I_MOV, reg_opd(ECX), reg_opd(EAX));
+            emit(left, NT_REG);
+            return;
+        }
+        emit(left, NT_REG);
+        push();
+        emit(right, NT_REG);
+        as.ins(I_MOV, reg_opd(ECX), reg_opd(EAX));
+        pop(EAX);
+    }
+
+    // Emits code deriving nonterminal nt of node n. Returns condition code for NT_CC, else -1.
+    int emit(int n, int nt){
+        sel_node_t& node = nodes[n];
+        const sel_rule_t& rule = sel_rules[node.rule[nt]];
+        int cc = -1;
+        switch (rule.action){
+            case A_OPERAND:
+                break;
+
+            case A_POP:
+                pop(EAX);
+                break;
+
+            case A_MOV:
+                as.ins(I_MOV, reg_opd(EAX), operand(n, rule.left));
+                break;
+
+            case A_LEA:
+                as.ins(I_LEA, reg_opd(EAX), lea_operand(node.addr));
+                break;
+
+            case A_SETCC:
+                cc = emit(n, NT_CC);
+                as.ins(I_MOV, reg_opd(EAX), imm_opd(0));       // doesn't change flags
+                as.setcc(cc);
+                cc = -1;
+                break;
+
+            case A_TEST_REG:
+                emit(n, NT_REG);
+                as.ins(I_TEST, reg_opd(EAX), reg_opd(EAX));
+                cc = CC_NE;
+                break;
+
+            case A_NEG:
+            case A_BITNOT:
+                emit(node.left, NT_REG);
+                as.ins(node.code, reg_opd(EAX));
+                break;
+
+            case A_ALU_RX:
+                emit(node.left, NT_REG);
+                as.ins(node.code, reg_opd(EAX), operand(node.right, rule.right));
+                break;
+
+            case A_ALU_XR:
+                emit(node.right, NT_REG);
+                as.ins(node.code, reg_opd(EAX), operand(node.left, rule.left));
+                break;
+
+            case A_SUB_XR:
+                emit(node.right, NT_REG);
+                as.ins(I_NEG, reg_opd(EAX));
+                as.ins(I_ADD, reg_opd(EAX), operand(node.left, rule.left));
+                break;
+
+            case A_MUL_IMM:
+                if (rule.left == NT_IMM){
+                    emit(node.right, NT_REG);
+                    mul_by_const(as, nodes[node.left].value);
+                } else {
+                    emit(node.left, NT_REG);
+                    mul_by_const(as, nodes[node.right].value);
+                }
+                break;
+
+            case A_DIV_IMM:
+                emit(node.left, NT_REG);
+                div_by_const(as, nodes[node.right].value);
+                break;
+
+            case A_DIV_RX:
+                emit(node.left, NT_REG);
+                as.ins(I_CDQ);
+                as.ins(I_IDIV, rm(node.right));
+                break;
+
+            case A_BIN:
+            case A_BIN_XR:
+                operands(node.left, node.right);
+                if (node.op == SEL_DIV){
+                    as.ins(I_CDQ);                      // sign extend EAX to EDX.
+                    as.ins(I_IDIV, reg_opd(ECX));       // quotient in EAX, remainder in EDX
+                } else {
+                    as.ins(node.code, reg_opd(EAX), reg_opd(ECX));
+                }
+                break;
+
+            case A_CMP_RX:
+                emit(node.left, NT_REG);
+                as.ins(I_CMP, reg_opd(EAX), operand(node.right, rule.right));
+                cc = node.code;
+                break;
+
+            case A_CMP_XI:
+                as.ins(I_CMP, rm(node.left), imm_opd(nodes[node.right].value));
+                cc = node.code;
+                break;
+
+            case A_CMP_VX:
+                as.ins(I_CMP, rm(node.left), rm(node.right));
+                cc = node.code;
+                break;
+
+            case A_CMP_XR:
+                emit(node.right, NT_REG);
+                as.ins(I_CMP, rm(node.left), reg_opd(EAX));
+                cc = node.code;
+                break;
+
+            case A_CMP_IR:
+                emit(node.right, NT_REG);
+                as.ins(I_CMP, reg_opd(EAX), imm_opd(nodes[node.left].value));
+                cc = swap_cc(node.code);
+                break;
+
+            case A_CMP:
+                operands(node.left, node.right);
+                as.ins(I_CMP, reg_opd(EAX), reg_opd(ECX));
+                cc = node.code;
+                break;
+
+            case A_TEST:
+                if (rule.left == NT_VREG){
+                    as.ins(I_TEST, rm(node.left), rm(node.left));
+                } else {
+                    emit(node.left, NT_REG);
+                    as.ins(I_TEST, reg_opd(EAX), reg_opd(EAX));
+                }
+                cc = node.code;
+                break;
+
+            case A_NOT:
+                emit(node.left, NT_REG);
+                as.ins(I_TEST, reg_opd(EAX), reg_opd(EAX));
+                cc = CC_E;
+                break;
+
+            case A_NOT_CC:
+                cc = negate_cc(emit(node.left, NT_CC));
+                break;
+        }
+        return cc;
+    }
+};
+
+int main (int argc, char ** argv){
+    // Options and files: input and output.
+    std::vector<std::pair<std::string, std::string>> files;
+    std::string pending_output;         // -o before the first input
+    size_t threads = 0;                 // not set
+    std::string serve_path;
+    size_t generate_functions = 0;
+    bool bench = false;
+    unsigned seed = 0;
+    bool run_benchmark = false;
+    std::string baseline;
+    bool save_baseline = false;
+    for (int i = 1; i < argc; i++){
+        std::string option = argv[i];
+        if (option.rfind("--inline-threshold=", 0) == 0){
+            inline_threshold = option_number(option, option.substr(19));
+        } else if (option.rfind("--unroll-budget=", 0) == 0){
+            unroll_budget = option_number(option, option.substr(16));
+        } else if (option.rfind("--target=", 0) == 0){
+            set_target(option.substr(9));
+        } else if (option == "-S"){
+            text_output = true;
+        } else if (option.rfind("--cache=", 0) == 0){
+            cache_dir = option.substr(8);
+        } else if (option.rfind("--cache-size=", 0) == 0){
+            cache_size = option_number(option, option.substr(13));
+        } else if (option.rfind("--serve=", 0) == 0){
+            serve_path = option.substr(8);
+        } else if (option.rfind("--connect=", 0) == 0){
+            connect_path = option.substr(10);
+        } else if (option.rfind("--generate=", 0) == 0){
+            generate_functions = option_number(option, option.substr(11));
+        } else if (option == "--bench"){
+            bench = true;
+        } else if (option == "--run-bench"){
+            run_benchmark = true;
+            set_target("x86-64");
+        } else if (option.rfind("--baseline=", 0) == 0){
+            baseline = option.substr(11);
+        } else if (option == "--save-baseline"){
+            save_baseline = true;
+        } else if (option.rfind("--seed=", 0) == 0){
+            seed = option_number(option, option.substr(7));
+        } else if (option == "--time-report"){
+            time_report = REPORT_TEXT;
+        } else if (option == "--time-report=json"){
+            time_report = REPORT_JSON;
+        } else if (option == "--incremental"){
+            incremental = true;
+        } else if (option == "-q"){
+            quiet = true;
+        } else if (option == "-o" && i + 1 < argc){
+            if (files.empty()){
+                pending_output = argv[++i];
+            } else {
+                files.back().second = argv[++i];
+            }
+        } else if (option.rfind("-j", 0) == 0){
+            std::string count = option.size() > 2 ? option.substr(2) : i + 1 < argc ? argv[++i] : "";
+            threads = std::max(option_number(option.size() > 2 ? option : option + " " + count, count), 1ul);
+        } else if (option == "--vm"){
+            vm = true;
+        } else if (option == "--tiered"){
+            vm = true;
+            tiered = true;
+            set_target("x86-64");
+        } else if (option.rfind("--tier-threshold=", 0) == 0){
+            tier_threshold = option_number(option, option.substr(17));
+        } else if (option == "--jit"){
+            jit = true;
+            set_target("x86-64");
+        } else if (option.size() > 1 && option[0] == '-'){
+            std::cout << "Unknown option: " << option << std::endl;
+            return 1;
+        } else {
+            files.emplace_back(option, pending_output);
+            pending_output.clear();
+        }
+    }
+    if (generate_functions > 0){
+        std::cout << synthetic_program(seed, generate_functions);
+        return 0;
+    }
+    if (bench){
+        return benchmark(seed);
+    }
+    if (!serve_path.empty()){
+        return serve(serve_path, threads > 0 ? threads : std::max(std::thread::hardware_concurrency(), 1u));
+    }
+    if (files.empty()){
+        std::cout << "No input files" << std::endl;
+        return 1;
+    }
+    if (run_benchmark){
+        std::vector<std::string> kernels;
+        for (const auto& file : files) kernels.push_back(file.first);
+        return run_bench(kernels, baseline, save_baseline);
+    }
+
+    // Program runs here: its value is the exit status.
+    if (vm || jit){
+        if (files.size() > 1){
+            std::cout << "Only one file can be run" << std::endl;
+            return 1;
+        }
+        try {
+            std::vector<AST> nodes = front_end(read_file(files[0].first));
+            optimize(nodes);
+            if (vm){
+                return vm_run(nodes);
+            }
+            Assembler as(nullptr, false);
+            to_asm(nodes, as);
+            if (!quiet) std::cout << "Code generation: done\n";
+            return jit_run(as);
+        } catch (const compile_error_t&){
+            return 1;
+        }
+    }
+
+    for (auto& file : files){
+        if (!file.second.empty()) continue;
+        size_t dot = file.first.rfind('.');
+        size_t slash = file.first.rfind('/');
+        std::string base = dot != std::string::npos && (slash == std::string::npos || dot > slash) ?
+                           file.first.substr(0, dot) : file.first;
+        file.second = base + (text_output ? ".s" : ".o");
+    }
+    std::vector<std::string> logs(files.size());
+    std::vector<char> failed(files.size(), 0);
+    const bool quiet_files = quiet;
+    run_jobs(files.size(), std::min(std::max(threads, (size_t)1), files.size()), [&](size_t k){
+        std::ostringstream log;
+        diag = &log;
+        quiet = quiet_files;
+        report = report_t();
+        try {
+            timed("total", [&](){
+                if (connect_path.empty()){
+                    compile(files[k].first, files[k].second);
+                } else {
+                    compile_remote(files[k].first, files[k].second);
+                }
+            });
+        } catch (const compile_error_t&){
+            failed[k] = 1;
+        } catch (const std::exception& error){
+            log << "Internal error: " << error.what() << std::endl;
+            failed[k] = 1;
+        }
+        if (time_report != REPORT_NONE) write_report(files[k].first, failed[k]);
+        logs[k] = log.str();
+    });
+
+    int status = 0;
+    for (size_t k = 0; k < files.size(); k++){
+        std::cout << logs[k];
+        if (files.size() > 1){
+            std::cout << files[k].first << (failed[k] ? ": failed" : ": ok") << std::endl;
+        }
+        if (failed[k]) status = 1;
+    }
+    return status;
+}
+
+std::vector<AST> front_end(const std::string& source){
+    // Lexer result.
+    tokens_t tokens;
+    timed("lexer", [&](){ tokens = lexer(source); });
+    report.tokens = tokens.size();
+    if (!quiet){
+        *diag << "Lexer: done\n";
+        out_tokens(tokens);
+    }
+    // Parser result.
+    std::vector<AST> nodes;
+    timed("parser", [&](){ nodes = parser(tokens); });
+    report.nodes.assign(EXPR_END + 1, 0);
+    for (AST& node : nodes){
+        report.nodes[node.check_type()]++;
+    }
+    if (!quiet) *diag << "Parser: done\n";
+    // Optimizations.
+    timed("callgraph", [&](){ callgraph(nodes); });
+    timed("inline_calls", [&](){ inline_calls(nodes); });
+    timed("callgraph", [&](){ callgraph(nodes); });
+    return nodes;
+}
+
+void optimize(std::vector<AST>& nodes){
+    timed("unroll", [&](){ unroll(nodes); });
+    timed("licm", [&](){ licm(nodes); });
+    timed("gvn", [&](){ gvn(nodes); });
+    timed("mem2reg", [&](){ mem2reg(nodes); });
+}
+
+void compile(const std::string& input, const std::string& output){
+    // Read source code from file.
+    std::string source;
+    timed("read", [&](){ source = read_file(input); });
+    report.bytes = source.size();
+    std::string code = generate(source, incremental && output != "-" ? output + ".fp" : "");
+    timed("write", [&](){
+        Sink out(output);
+        out.put(code);
+        out.flush();
+    });
+}
+
+std::string generate(const std::string& source, const std::string& functions_path){
+    std::string key;
+    std::string code;
+    if (!cache_dir.empty()){
+        bool hit = false;
+        timed("cache", [&](){
+            key = cache_key(source);
+            hit = cache_load(key, code);
+        });
+        if (hit){
+            if (!quiet) *diag << "Cache: hit\n";
+            return code;
+        }
+    }
+    std::vector<AST> nodes = front_end(source);
+
+    // Functions, from FUNC_DECL to FUNC_PARAMS. Saved code is reused for those not changed.
+    bool saving = !functions_path.empty();
+    std::map<std::string, chunk_t> saved;
+    if (saving) saved = load_chunks(functions_path);
+    std::string options = options_key();
+    std::vector<std::pair<std::string, chunk_t>> chunks;        // fingerprint and code of each function
+    size_t reused = 0;
+    for (size_t start = 0; start < nodes.size();){
+        size_t end = start + 1;
+        while (end < nodes.size() && nodes[end].check_type() != FUNC_DECL) end++;
+        std::vector<AST> function(nodes.begin() + start, nodes.begin() + end);
+        start = end;
+        if (function.back().check_type() != FUNC_PARAMS) continue;     // declaration without body
+        std::string print = fingerprint(options, function);
+        auto found = saved.find(print);
+        if (found != saved.end()){
+            chunks.emplace_back(print, found->second);
+            reused++;
+            continue;
+        }
+        optimize(function);
+        chunk_t chunk;
+        chunk.name = function[0].check_func_name();
+        {
+            Sink out(&chunk.code);
+            Assembler as(&out, text_output, true);
+            timed("to_asm", [&](){ to_asm(function, as); });
+            as.part(chunk);
+        }
+        chunks.emplace_back(print, chunk);
+    }
+
+    // Code generation, into memory: nothing is written if it fails.
+    timed("assembler", [&](){
+        Sink out(&code);
+        Assembler as(&out, text_output);
+        for (const auto& chunk : chunks){
+            as.splice(chunk.second);
+        }
+        as.finish();
+    });
+    if (!quiet){
+        *diag << "Code generation: done\n";
+        if (saving) *diag << "Incremental: " << reused << " of " << chunks.size() << " functions reused\n";
+    }
+    if (!key.empty()) cache_store(key, code);
+    if (saving) save_chunks(functions_path, chunks);
+    return code;
+}
+
+void run_jobs(size_t count, size_t threads, const std::function<void(size_t)>& job){
+    struct queue_t {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+    std::vector<queue_t> queues(threads);
+    for (size_t k = 0; k < count; k++){
+        queues[k % threads].jobs.push_back(k);
+    }
+    // Jobs are not added while they run, so a thread which finds all queues empty is done.
+    auto worker = [&](size_t self){
+        while (true){
+            size_t next = 0;
+            bool found = false;
+            for (size_t k = 0; k < threads && !found; k++){
+                queue_t& queue = queues[(self + k) % threads];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if (queue.jobs.empty()) continue;
+                if (k == 0){
+                    next = queue.jobs.back();
+                    queue.jobs.pop_back();
+                } else {
+                    next = queue.jobs.front();
+                    queue.jobs.pop_front();
+                }
+                found = true;
+            }
+            if (!found) return;
+            job(next);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++){
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& thread : pool){
+        thread.join();
+    }
+}
+
+std::string sha256(const std::string& data){
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n){ return (x >> n) | (x << (32 - n)); };
+
+    // Padding: 0x80, zeros, length in bits (big-endian), to a multiple of 64 bytes.
+    std::string message = data;
+    message += (char)0x80;
+    while (message.size() % 64 != 56) message += (char)0;
+    uint64_t bits = (uint64_t)data.size() * 8;
+    for (int i = 7; i >= 0; i--) message += (char)(bits >> (i * 8));
+
+    for (size_t block = 0; block < message.size(); block += 64){
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++){
+            const unsigned char *p = (const unsigned char *)message.data() + block + i * 4;
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 64; i++){
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++){
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    std::string digest;
+    for (uint32_t word_value : h){
+        for (int i = 28; i >= 0; i -= 4) digest += digits[(word_value >> i) & 15];
+    }
+    return digest;
+}
+
+std::string options_key(){
+    std::ostringstream key;
+    key << compiler_version << '\n'
+        << "target=" << (x86_64 ? "x86-64" : "i386") << " text=" << text_output
+        << " inline-threshold=" << inline_threshold << " unroll-budget=" << unroll_budget << '\n';
+    return key.str();
+}
+
+std::string cache_key(const std::string& source){
+    return sha256(options_key() + source);
+}
+
+bool cache_load(const std::string& key, std::string& output){
+    std::string path = cache_dir + "/" + key;
+    std::ifstream file (path, std::ios::binary);
+    if (!file.is_open()) return false;
+    std::ostringstream content;
+    content << file.rdbuf();
+    output = content.str();
+    utime(path.c_str(), nullptr);       // most recently used
+    return true;
+}
+
+void cache_store(const std::string& key, const std::string& output){
+    // Cache is only an optimization: entries which can't be written are skipped.
+    mkdir(cache_dir.c_str(), 0755);
+    std::string temporary = cache_dir + "/tmp." + std::to_string(getpid()) + "." +
+                            std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file (temporary, std::ios::binary | std::ios::trunc);
+        file.write(output.data(), output.size());
+        if (!file.good()){
+            file.close();
+            unlink(temporary.c_str());
+            return;
+        }
+    }
+    if (rename(temporary.c_str(), (cache_dir + "/" + key).c_str()) != 0){
+        unlink(temporary.c_str());
+        return;
+    }
+
+    // Eviction, oldest first. Entries removed here while read by others stay readable to them.
+    struct entry_t {
+        time_t used;
+        size_t size;
+        std::string name;
+    };
+    std::vector<entry_t> entries;
+    size_t total = 0;
+    DIR *directory = opendir(cache_dir.c_str());
+    if (!directory) return;
+    while (dirent *item = readdir(directory)){
+        std::string name = item->d_name;
+        struct stat status;
+        if (name.size() != 64 || stat((cache_dir + "/" + name).c_str(), &status) != 0) continue;
+        entries.push_back({status.st_mtime, (size_t)status.st_size, name});
+        total += status.st_size;
+    }
+    closedir(directory);
+    if (total <= cache_size) return;
+    std::sort(entries.begin(), entries.end(), [](const entry_t& a, const entry_t& b){ return a.used < b.used; });
+    for (const entry_t& entry : entries){
+        if (total <= cache_size) break;
+        if (entry.name == key) continue;        // just stored
+        unlink((cache_dir + "/" + entry.name).c_str());
+        total -= entry.size;
+    }
+}
+
+std::string fingerprint(const std::string& options, std::vector<AST>& function){
+    // Names and operators have no spaces or line breaks.
+    std::string data = options;
+    for (AST& node : function){
+        data += std::to_string(node.check_type()) + ' ' + node.check_func_name() + ' ' + node.check_var_name() +
+                ' ' + node.check_op() + ' ' + std::to_string(node.check_inum()) + ' ' + std::to_string(node.check_reg()) + '\n';
+    }
+    return sha256(data);
+}
+
+/*
+ * Saved functions: a line "cvv-functions", then for each one a line
+ * "fingerprint name size calls", its code (size bytes) and a line "offset callee" for each call.
+ */
+std::map<std::string, chunk_t> load_chunks(const std::string& path){
+    std::map<std::string, chunk_t> chunks;
+    std::ifstream file (path, std::ios::binary);
+    std::string magic;
+    if (!std::getline(file, magic) || magic != "cvv-functions") return chunks;
+    std::string print;
+    chunk_t chunk;
+    size_t size = 0;
+    size_t calls = 0;
+    while (file >> print >> chunk.name >> size >> calls && file.get() == '\n'){
+        chunk.code.resize(size);
+        if (!file.read(&chunk.code[0], size)) break;
+        chunk.calls.resize(calls);
+        for (auto& call : chunk.calls){
+            file >> call.first >> call.second;
+        }
+        if (!file) break;
+        chunks[print] = chunk;
+    }
+    return chunks;
+}
+
+void save_chunks(const std::string& path, const std::vector<std::pair<std::string, chunk_t>>& chunks){
+    // Written aside and renamed, like cache entries: a build which stops leaves the old file.
+    std::string temporary = path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file (temporary, std::ios::binary | std::ios::trunc);
+        file << "cvv-functions\n";
+        for (const auto& item : chunks){
+            const chunk_t& chunk = item.second;
+            file << item.first << ' ' << chunk.name << ' ' << chunk.code.size() << ' ' << chunk.calls.size() << '\n';
+            file.write(chunk.code.data(), chunk.code.size());
+            for (const auto& call : chunk.calls){
+                file << call.first << ' ' << call.second << '\n';
+            }
+        }
+        if (!file.good()){
+            file.close();
+            unlink(temporary.c_str());
+            return;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) unlink(temporary.c_str());
+}
+
+int serve(const std::string& path, size_t threads){
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || path.size() >= sizeof(address.sun_path)){
+        std::cout << "Can't create socket: " << path << std::endl;
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    // Socket left by a server which was killed is replaced; anything else at the path is kept.
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0){
+        if (!S_ISSOCK(status.st_mode)){
+            std::cout << "Not a socket: " << path << std::endl;
+            return 1;
+        }
+        if (connect(listener, (sockaddr *)&address, sizeof(address)) == 0){
+            std::cout << "Server is already running: " << path << std::endl;
+            return 1;
+        }
+        close(listener);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+    }
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0){
+        std::cout << "Can't listen on socket: " << path << std::endl;
+        return 1;
+    }
+    strcpy(serve_socket, path.c_str());
+    signal(SIGINT, [](int){ unlink(serve_socket); _exit(0); });
+    signal(SIGTERM, [](int){ unlink(serve_socket); _exit(0); });
+    signal(SIGPIPE, SIG_IGN);       // client which went away is an error of write, not a signal
+    if (!quiet) std::cout << "Server: listening on " << path << " with " << threads << " threads" << std::endl;
+
+    // Threads take connections themselves, one request each, and keep their buffers between them.
+    const std::string options = options_key();
+    auto worker = [&](){
+        std::string request_options;
+        std::string source;
+        std::string flags;
+        std::string code;
+        std::ostringstream log;
+        diag = &log;
+        while (true){
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0){
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            bool ok = false;
+            code.clear();
+            log.str("");
+            if (read_frame(client, request_options) && read_frame(client, source) && read_frame(client, flags)){
+                quiet = flags == "-q";
+                try {
+                    if (request_options != options){
+                        log << "Options are not those of the server" << std::endl;
+                        throw compile_error_t();
+                    }
+                    code = generate(source, "");
+                    ok = true;
+                } catch (const compile_error_t&){
+                    code.clear();
+                } catch (const std::exception& error){
+                    log << "Internal error: " << error.what() << std::endl;
+                    code.clear();
+                }
+                write_frame(client, ok ? "ok" : "failed") && write_frame(client, code) && write_frame(client, log.str());
+            }
+            close(client);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++){
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool){
+        thread.join();
+    }
+    close(listener);
+    unlink(path.c_str());
+    return 1;
+}
+
+void compile_remote(const std::string& input, const std::string& output){
+    std::string source;
+    timed("read", [&](){ source = read_file(input); });
+    report.bytes = source.size();
+    if (source.size() > max_frame){
+        *diag << "Input file is too large for the server: " << input << std::endl;
+        throw compile_error_t();
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, connect_path.c_str(), sizeof(address.sun_path) - 1);
+    if (server < 0 || connect(server, (sockaddr *)&address, sizeof(address)) != 0){
+        if (server >= 0) close(server);
+        *diag << "Can't connect to server: " << connect_path << std::endl;
+        throw compile_error_t();
+    }
+    std::string status;
+    std::string code;
+    std::string messages;
+    bool answered = false;
+    timed("server", [&](){
+        answered = write_frame(server, options_key()) && write_frame(server, source) &&
+                   write_frame(server, quiet ? "-q" : "") && read_frame(server, status) &&
+                   read_frame(server, code) && read_frame(server, messages);
+    });
+    close(server);
+    if (!answered){
+        *diag << "No answer from server: " << connect_path << std::endl;
+        throw compile_error_t();
+    }
+    *diag << messages;
+    if (status != "ok") throw compile_error_t();
+    Sink out(output);
+    out.put(code);
+    out.flush();
+}
+
+bool write_frame(int fd, const std::string& data){
+    std::string frame(4, '\0');
+    for (int k = 0; k < 4; k++){
+        frame[k] = (char)(data.size() >> (8 * k));
+    }
+    frame += data;
+    size_t done = 0;
+    while (done < frame.size()){
+        ssize_t written = send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        done += written;
+    }
+    return true;
+}
+
+bool read_frame(int fd, std::string& data){
+    unsigned char header[4];
+    size_t size = 0;
+    auto read_all = [fd](char *buffer, size_t count){
+        while (count > 0){
+            ssize_t got = read(fd, buffer, count);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            buffer += got;
+            count -= got;
+        }
+        return true;
+    };
+    if (!read_all((char *)header, 4)) return false;
+    for (int k = 0; k < 4; k++){
+        size |= (size_t)header[k] << (8 * k);
+    }
+    if (size > max_frame) return false;
+    // Memory grows with the data which came, not with the length the peer claims.
+    data.clear();
+    while (data.size() < size){
+        size_t done = data.size();
+        data.resize(done + std::min(size - done, (size_t)1 << 16));
+        if (!read_all(&data[done], data.size() - done)) return false;
+    }
+    return true;
+}
+
+void timed(const char *phase, const std::function<void()>& run){
+    if (time_report == REPORT_NONE){
+        run();
+        return;
+    }
+    auto cpu_time = [](){
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);     // of this thread: files are compiled on several
+        return time.tv_sec + time.tv_nsec * 1e-9;
+    };
+    auto wall_start = std::chrono::steady_clock::now();
+    double cpu_start = cpu_time();
+    auto add = [&](){
+        if (report.times.find(phase) == report.times.end()) report.phases.emplace_back(phase);
+        std::pair<double, double>& time = report.times[phase];
+        time.first += std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+        time.second += cpu_time() - cpu_start;
+    };
+    try {
+        run();
+    } catch (...){
+        add();          // phase which failed is reported too
+        throw;
+    }
+    add();
+}
+
+void write_report(const std::string& file, bool failed){
+    const std::pair<const char *, long> counters[] = {
+        {"bytes", report.bytes}, {"tokens", report.tokens}, {"instructions", report.instructions},
+        {"labels", report.labels}, {"symbol_lookups", report.lookups},
+    };
+    std::ostream& out = *diag;
+    if (time_report == REPORT_TEXT){
+        out << "Time report: " << file << (failed ? " (failed)" : "") << "\n";
+        out << "  " << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "wall ms"
+            << std::setw(12) << "cpu ms" << "\n" << std::fixed << std::setprecision(3);
+        for (const std::string& phase : report.phases){
+            out << "  " << std::left << std::setw(16) << phase << std::right
+                << std::setw(12) << report.times[phase].first * 1000 << std::setw(12) << report.times[phase].second * 1000 << "\n";
+        }
+        out.unsetf(std::ios::floatfield);
+        out << " ";
+        for (const auto& counter : counters){
+            out << ' ' << counter.first << ' ' << counter.second;
+        }
+        out << "\n  nodes:";
+        for (size_t type = 0; type < report.nodes.size(); type++){
+            if (report.nodes[type] > 0) out << ' ' << type_names[type] << ' ' << report.nodes[type];
+        }
+        out << std::endl;
+        return;
+    }
+
+    // JSON: names of files are escaped, the rest are plain names and numbers.
+    out << "{\"file\": \"";
+    for (char c : file){
+        if (c == '"' || c == '\\'){
+            out << '\\' << c;
+        } else if ((unsigned char)c < 0x20){
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << "\", \"compiler\": \"" << compiler_version << "\", \"status\": \"" << (failed ? "failed" : "ok") << "\", \"phases\": {";
+    out << std::fixed << std::setprecision(6);
+    for (size_t k = 0; k < report.phases.size(); k++){
+        const std::pair<double, double>& time = report.times[report.phases[k]];
+        out << (k > 0 ? ", " : "") << '"' << report.phases[k] << "\": {\"wall_ms\": " << time.first * 1000
+            << ", \"cpu_ms\": " << time.second * 1000 << '}';
+    }
+    out.unsetf(std::ios::floatfield);
+    out << "}, \"counters\": {";
+    for (const auto& counter : counters){
+        out << '"' << counter.first << "\": " << counter.second << ", ";
+    }
+    out << "\"nodes\": {";
+    bool first = true;
+    for (size_t type = 0; type < report.nodes.size(); type++){
+        if (report.nodes[type] == 0) continue;
+        out << (first ? "" : ", ") << '"' << type_names[type] << "\": " << report.nodes[type];
+        first = false;
+    }
+    out << "}}}" << std::endl;
+}
+
+std::string synthetic_program(unsigned seed, size_t functions, int statements){
+    const int params = 3;
+    const int locals = 2 * statements;
+    const int max_depth = 4;            // of nested statements
+    uint32_t state = seed * 2654435761u + 1;
+    auto random = [&](uint32_t range){
+        state = state * 1103515245u + 12345u;
+        return (int)((state >> 8) % range);
+    };
+    std::ostringstream out;
+    size_t names = 0;                   // loop counters have names of their own
+
+    // Chain of operands; divisions are by constants, so programs run without errors.
+    std::function<std::string(int)> expr = [&](int length){
+        std::string result;
+        for (int k = 0; k < length; k++){
+            if (k > 0){
+                const char *ops[] = {" + ", " - ", " * ", " + ", " - "};
+                result += ops[random(5)];
+            }
+            switch (random(8)){
+                case 0:
+                    result += std::to_string(random(100));
+                    break;
+                case 1:
+                    result += "(v" + std::to_string(random(locals)) + " / " + std::to_string(2 + random(8)) + ")";
+                    break;
+                case 2:
+                    result += "(v" + std::to_string(random(locals)) + " < v" + std::to_string(random(locals)) +
+                              " ? " + std::to_string(random(10)) + " : v" + std::to_string(random(locals)) + ")";
+                    break;
+                default:
+                    result += "v" + std::to_string(random(locals));
+            }
+        }
+        return result;
+    };
+    auto condition = [&](){
+        const char *ops[] = {" < ", " > ", " <= ", " >= ", " == ", " != "};
+        std::string result = "v" + std::to_string(random(locals)) + ops[random(6)] + expr(1 + random(3));
+        if (random(3) == 0) result += (random(2) ? " && v" : " || v") + std::to_string(random(locals)) + " > 0";
+        return result;
+    };
+    std::function<void(int)> statement = [&](int depth){
+        std::string indent(4 * depth, ' ');
+        int kind = depth >= max_depth ? 0 : random(6);
+        std::string name = std::to_string(names++);
+        if (kind == 1){
+            out << indent << "if (" << condition() << ") {\n";
+            for (int k = random(3); k >= 0; k--) statement(depth + 1);
+            out << indent << "} else {\n";
+            statement(depth + 1);
+            out << indent << "}\n";
+        } else if (kind == 2){
+            out << indent << "for (int i" << name << " = 0; i" << name << " < " << 2 + random(3) << "; i" << name << " = i" << name << " + 1) {\n";
+            for (int k = random(3); k >= 0; k--) statement(depth + 1);
+            out << indent << "}\n";
+        } else if (kind == 3){
+            out << indent << "int w" << name << " = " << 1 + random(4) << ";\n";
+            out << indent << "while (w" << name << " > 0) {\n";
+            out << indent << "    w" << name << " = w" << name << " - 1;\n";
+            for (int k = random(2); k >= 0; k--) statement(depth + 1);
+            out << indent << "}\n";
+        } else {
+            out << indent << "v" << random(locals) << " = " << expr(2 + random(12)) << ";\n";
+        }
+    };
+
+    for (size_t f = 0; f < functions; f++){
+        out << "int f" << f << "(int a, int b, int c) {\n";
+        for (int v = 0; v < locals; v++){
+            const char *inputs[params] = {"a", "b", "c"};
+            out << "    int v" << v << " = " << inputs[v % params] << " + " << v << ";\n";
+        }
+        for (int k = 0; k < statements; k++) statement(1);
+        out << "    return " << expr(3);
+        if (f > 0){
+            out << " + f" << random(f) << "(v" << random(locals) << " / 16, v" << random(locals) << " / 16, c - 1)";
+        }
+        out << ";\n}\n";
+    }
+    out << "int main() {\n    int s = 0;\n";
+    for (size_t f = 0; f < functions; f++){
+        out << "    s = s + f" << f << "(" << f << ", 1, 2);\n";
+    }
+    out << "    return s;\n}\n";
+    return out.str();
+}
+
+int benchmark(unsigned seed){
+    quiet = true;
+    time_report = REPORT_TEXT;          // phases are timed
+    cache_dir.clear();
+    std::cout << "Benchmark (seed " << seed << "): MB/s and thousands of tokens/s of the source for each phase\n";
+
+    // Programs of a series (number of functions and statements in each), compiled as files are.
+    auto series = [&](const char *title, bool by_functions, const std::vector<std::pair<size_t, int>>& sizes){
+        std::vector<report_t> reports;
+        for (const auto& size : sizes){
+            std::string source = synthetic_program(seed, size.first, size.second);
+            report_t best;
+            for (int run = 0; run < bench_compiles; run++){
+                report = report_t();
+                report.bytes = source.size();
+                try {
+                    generate(source, "");
+                } catch (const compile_error_t&){
+                    std::cout << "Benchmark program doesn't compile" << std::endl;
+                    return false;
+                }
+                if (run == 0){
+                    best = report;
+                    continue;
+                }
+                for (auto& time : best.times){
+                    time.second.first = std::min(time.second.first, report.times.at(time.first).first);
+                    time.second.second = std::min(time.second.second, report.times.at(time.first).second);
+                }
+            }
+            reports.emplace_back(best);
+        }
+
+        std::cout << "\n" << std::left << std::setw(14) << title << std::right;
+        for (const auto& size : sizes){
+            std::cout << std::setw(16) << (by_functions ? size.first : (size_t)size.second);
+        }
+        std::cout << std::setw(10) << "exponent" << "\n" << std::left << std::setw(14) << "bytes" << std::right;
+        for (const report_t& run : reports) std::cout << std::setw(16) << run.bytes;
+        std::cout << "\n" << std::left << std::setw(14) << "tokens" << std::right;
+        for (const report_t& run : reports) std::cout << std::setw(16) << run.tokens;
+        std::cout << "\n";
+        for (const std::string& phase : reports.back().phases){
+            std::cout << std::left << std::setw(14) << phase << std::right;
+            for (const report_t& run : reports){
+                double seconds = std::max(run.times.at(phase).first, 1e-9);
+                std::ostringstream cell;
+                cell << std::fixed << std::setprecision(2) << run.bytes / seconds / 1e6 << " " << std::setprecision(0)
+                     << run.tokens / seconds / 1e3;
+                std::cout << std::setw(16) << cell.str();
+            }
+            double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+            for (const report_t& run : reports){
+                double x = std::log((double)run.bytes);
+                double y = std::log(std::max(run.times.at(phase).first, 1e-9));
+                sum_x += x;
+                sum_y += y;
+                sum_xx += x * x;
+                sum_xy += x * y;
+            }
+            double n = reports.size();
+            double exponent = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x);
+            std::cout << std::fixed << std::setw(10) << std::setprecision(2) << exponent
+                      << (exponent > 1.3 ? "  non-linear" : "") << "\n";
+            std::cout.unsetf(std::ios::floatfield);
+        }
+        return true;
+    };
+    bool ok = series("functions", true, {{25, 8}, {50, 8}, {100, 8}, {200, 8}, {400, 8}}) &&
+              series("statements", false, {{4, 25}, {4, 50}, {4, 100}, {4, 200}});
+    return ok ? 0 : 1;
+}
+
+int run_bench(const std::vector<std::string>& kernels, const std::string& baseline, bool save){
+    quiet = true;
+    if (save && baseline.empty()){
+        std::cout << "No baseline file" << std::endl;
+        return 1;
+    }
+
+    // Baseline: a line for each kernel, lines from # are comments.
+    std::map<std::string, run_counters_t> expected;
+    if (!baseline.empty() && !save){
+        std::ifstream in(baseline);
+        if (!in){
+            std::cout << "Can't open baseline file" << std::endl;
+            return 1;
+        }
+        std::string line;
+        while (std::getline(in, line)){
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream fields(line);
+            std::string name;
+            run_counters_t counters;
+            fields >> name >> counters.value >> counters.ns >> counters.cycles >> counters.instructions >> counters.branch_misses;
+            if (fields) expected[name] = counters;
+        }
+    }
+
+    // Counter with its change from the baseline.
+    auto cell = [](long value, long base, double scale, int precision){
+        if (value < 0) return std::string("-");
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(precision) << value / scale;
+        if (base > 0){
+            text << std::showpos << std::setprecision(1) << " (" << 100.0 * (value - base) / base << "%)";
+        }
+        return text.str();
+    };
+    auto least = [](long a, long b){ return a < 0 || b < 0 ? -1 : std::min(a, b); };
+
+    std::cout << std::left << std::setw(14) << "kernel" << std::right << std::setw(12) << "value" << std::setw(22)
+              << "CPU ms" << std::setw(24) << "cycles" << std::setw(24) << "instructions" << std::setw(22)
+              << "branch misses" << std::endl;
+    int status = 0;
+    bool counted = true;
+    std::vector<std::pair<std::string, run_counters_t>> results;
+    for (const std::string& kernel : kernels){
+        size_t slash = kernel.rfind('/');
+        std::string name = slash == std::string::npos ? kernel : kernel.substr(slash + 1);
+        run_counters_t best;
+        try {
+            std::vector<AST> nodes = front_end(read_file(kernel));
+            optimize(nodes);
+            Assembler as(nullptr, false);
+            to_asm(nodes, as);
+            std::map<std::string, void *> addresses = jit_load(as);
+            if (addresses.find("main") == addresses.end()){
+                *diag << "JIT: main is not defined" << std::endl;
+                throw compile_error_t();
+            }
+            for (int run = 0; run < bench_runs; run++){
+                run_counters_t counters = count_run((int (*)())addresses["main"]);
+                if (run == 0){
+                    best = counters;
+                    continue;
+                }
+                best.ns = least(best.ns, counters.ns);
+                best.cycles = least(best.cycles, counters.cycles);
+                best.instructions = least(best.instructions, counters.instructions);
+                best.branch_misses = least(best.branch_misses, counters.branch_misses);
+            }
+        } catch (const compile_error_t&){
+            std::cout << name << ": failed" << std::endl;
+            status = 1;
+            continue;
+        }
+        results.emplace_back(name, best);
+        if (best.cycles < 0) counted = false;
+
+        run_counters_t base;
+        base.ns = base.cycles = base.instructions = base.branch_misses = 0;
+        auto found = expected.find(name);
+        if (found != expected.end()) base = found->second;
+        std::cout << std::left << std::setw(14) << name << std::right << std::setw(12) << best.value
+                  << std::setw(22) << cell(best.ns, base.ns, 1e6, 3)
+                  << std::setw(24) << cell(best.cycles, base.cycles, 1, 0)
+                  << std::setw(24) << cell(best.instructions, base.instructions, 1, 0)
+                  << std::setw(22) << cell(best.branch_misses, base.branch_misses, 1, 0) << std::endl;
+        if (found != expected.end() && best.value != base.value){
+            std::cout << name << ": value " << best.value << ", baseline " << base.value << std::endl;
+            status = 1;
+        }
+    }
+    if (!counted) std::cout << "Hardware counters are not available: CPU time only" << std::endl;
+
+    if (save){
+        std::ofstream out(baseline);
+        out << "# kernel value ns cycles instructions branch_misses (-1: not counted)\n";
+        for (const auto& result : results){
+            const run_counters_t& counters = result.second;
+            out << result.first << " " << counters.value << " " << counters.ns << " " << counters.cycles << " "
+                << counters.instructions << " " << counters.branch_misses << "\n";
+        }
+        if (!out){
+            std::cout << "Can't write baseline file" << std::endl;
+            return 1;
+        }
+    }
+    return status;
+}
+
+run_counters_t count_run(int (*main_function)()){
+    run_counters_t counters;
+#ifdef __linux__
+    const unsigned long events[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES};
+    long *values[] = {&counters.cycles, &counters.instructions, &counters.branch_misses};
+    int fds[3];
+    for (int k = 0; k < 3; k++){
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = events[k];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);     // this thread, any CPU
+    }
+    for (int fd : fds){
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    counters.value = main_function();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+#ifdef __linux__
+    for (int k = 0; k < 3; k++){
+        if (fds[k] < 0) continue;
+        ioctl(fds[k], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count;
+        if (read(fds[k], &count, sizeof(count)) == sizeof(count)) *values[k] = count;
+        close(fds[k]);
+    }
+#endif
+    counters.ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    return counters;
+}
+
+// Interaction with variables and constants via stack.
+// AST nodes are in order of assembler generation.
+void to_asm(std::vector<AST>& ast, Assembler& as){
+
+    size_t temp;
+    size_t temp_slots;
+    int inum;
+    size_t label = 0;           // to maintain labels in assembly code.
+    long int stack_index = -word;   // position on stack frame.
+
+    dvar_t decl_vars;       // Local variables are saved on the stack.
+                            // We need to remember exact position of each variable on the stack.
+                            // A map from variable names to locations
+    std::stack<size_t> labels;
+    std::stack<size_t> size_dv;
+    std::stack<long int> cond_stack;    // stack_index at the start of each ternary arm.
+    std::stack<size_t> loops;           // first label of each enclosing loop.
+    std::stack<size_t> inline_labels;   // return label of each inlined body.
+    std::string func_name;              // function being generated,
+    size_t func_params = 0;             // its number of parameters
+    size_t func_label = 0;              // and label at the start of its body.
+    size_t func_saved = 0;              // Number of var_regs it saves.
+    std::vector<std::pair<int, long int>> func_homes;   // register or else offset of each parameter.
+    std::stack<long int> call_pads;     // bytes added to align the stack for each call.
+    std::stack<long int> inline_stack;  // stack_index before arguments of each inlined body.
+    bool frame_pointer = true;          // leaf functions address their frame by ESP.
+    std::vector<AST> functions;
+
+    /*
+     * Memory operand at offset from the frame pointer. Without it, offsets are from the stack
+     * pointer at the entry and the same place is found from the stack pointer and stack_index.
+     */
+    auto frame = [&](long int offset){
+        if (frame_pointer){
+            return mem_opd(EBP, offset);
+        }
+        return mem_opd(ESP, offset - stack_index - word);
+    };
+    // Labels are numbered from 0 in each function, so its code doesn't depend on the others.
+    auto label_name = [&](const char *prefix, size_t index){
+        return func_name + "." + prefix + std::to_string(index);
+    };
+
+    // Expressions are selected by trees. Condition of a jump may be left in flags instead of on the stack.
+    Selector selector(as, stack_index, frame);
+    int flags = -1;
+
+    // Condition code which is true when the condition on top of the stack is; takes it off the stack.
+    auto condition = [&](){
+        int cc = flags;
+        flags = -1;
+        if (cc < 0){
+            as.ins(I_POP, wide_opd(EAX));
+            stack_index += word;
+            as.ins(I_TEST, reg_opd(EAX), reg_opd(EAX));
+            cc = CC_NE;
+        }
+        return cc;
+    };
+
+    size_dv.push(0);
+    size_t current = 0;
+    // Value in EAX is pushed for the next node, unless it is returned.
+    auto push_value = [&](){
+        if (current + 1 < ast.size() && ast[current + 1].check_type() == RET) return;
+        as.ins(I_PUSH, wide_opd(EAX));
+        stack_index -= word;
+    };
+    while (current < ast.size()){
+        switch (ast[current].check_type()){
+            case CALL_BEGIN:        // stack is aligned so that it is at the call, when only stack arguments are left.
+                inum = word * (ast[current].check_inum() - ast[current].check_reg());
+                temp = (((16 - word + stack_index - inum) % 16) + 16) % 16;    // frame pointer is 16 - 2 * word modulo 16
+                if (temp > 0){
+                    as.ins(I_SUB, wide_opd(ESP), imm_opd(temp));
+                    stack_index -= temp;
+                }
+                call_pads.push(temp);
+                current++;
+                break;
+
+            /*
+             * Arguments are on the stack, first one on top, except those the selector
+             * put straight into their registers (args_in_regs).
+             */
+            case FUNC_CALL: {
+                inum = ast[current].check_inum();
+                int regs = ast[current].check_reg();
+                unsigned in_regs = selector.args_in_regs();
+                int pushed = inum;
+                for (int arg = 0; arg < regs; arg++){
+                    if (in_regs & (1u << arg)) pushed--;
+                }
+                /*
+                 * Tail call: arguments are moved into our own parameters and the frame is dropped.
+                 * Call to itself becomes a jump to the start of the body. Other function
+                 * is jumped to and returns straight to our caller, who removes
+                 * as many arguments as it pushed, so it can't take more from the stack than we do.
+                 */
+                if (current + 1 < ast.size() && ast[current + 1].check_type() == RET &&
+                    ast[current].check_func_name() == func_name){
+                    for (int arg = 0; arg < inum; arg++){
+                        if (in_regs & (1u << arg)){
+                            if (func_homes[arg].first >= 0){
+                                as.ins(I_MOV, reg_opd(var_regs[func_homes[arg].first]), reg_opd(arg_regs[arg]));
+                            } else {
+                                as.ins(I_MOV, frame(func_homes[arg].second), reg_opd(arg_regs[arg]));
+                            }
+                        } else if (func_homes[arg].first >= 0){
+                            as.ins(I_POP, wide_opd(var_regs[func_homes[arg].first]));
+                            stack_index += word;
+                        } else {
+                            as.ins(I_POP, wide_opd(EAX));
+                            stack_index += word;
+                            as.ins(I_MOV, frame(func_homes[arg].second), reg_opd(EAX));
+                        }
+                    }
+                    if (call_pads.top() > 0){
+                        as.ins(I_ADD, wide_opd(ESP), imm_opd(call_pads.top()));
+                    }
+                    as.ins(I_JMP, label_opd(label_name("label", func_label)));
+                    stack_index += call_pads.top();
+                    call_pads.pop();
+                    current += 2;
+                    break;
+                }
+                if (current + 1 < ast.size() && ast[current + 1].check_type() == RET &&
+                    inum - regs <= std::max((int)func_params - reg_args_num, 0)){
+                    for (int arg = 0; arg < inum; arg++){
+                        if (in_regs & (1u << arg)) continue;
+                        if (arg < regs){
+                            as.ins(I_POP, wide_opd(arg_regs[arg]));
+                        } else {
+                            as.ins(I_POP, wide_opd(EAX));
+                            as.ins(I_MOV, mem_opd(EBP, 2 * word + word * (arg - regs)), reg_opd(EAX));
+                        }
+                    }
+                    epilogue(as, func_saved, stack_index, frame_pointer);
+                    as.ins(I_JMP, symbol_opd(ast[current].check_func_name()));
+                    stack_index += word * pushed + call_pads.top();
+                    call_pads.pop();
+                    current += 2;
+                    break;
+                }
+
+                for (int arg = 0; arg < regs; arg++){
+                    if (!(in_regs & (1u << arg))) as.ins(I_POP, wide_opd(arg_regs[arg]));
+                }
+                as.ins(I_CALL, symbol_opd(ast[current].check_func_name()));
+                temp = word * (inum - regs) + call_pads.top();
+                if (temp > 0){
+                    as.ins(I_ADD, wide_opd(ESP), imm_opd(temp));
+                }
+                stack_index += word * pushed + call_pads.top();
+                call_pads.pop();
+                push_value();
+                current++;
+                break;
+            }
+
+            /*
+             * Inlined function body.
+             * Arguments stay where the caller pushed them and become parameters.
+             * Return jumps to the end, where everything the body left on the stack is dropped.
+             */
+            case INLINE_BEGIN:
+                inline_stack.push(stack_index + word * ast[current].check_inum());
+                inline_labels.push(label);
+                label++;
+                current++;
+                break;
+
+            case ARG_BIND:          // parameter inum places below the top of the stack.
+                decl_vars.emplace_back(ast[current].check_var_name(), stack_index + word + word * ast[current].check_inum());
+                current++;
+                break;
+
+            case INLINE_RET:
+                as.ins(I_POP, wide_opd(EAX));
+                stack_index += word;
+                as.ins(I_JMP, label_opd(label_name("end_label", inline_labels.top())));
+                current++;
+                break;
+
+            case INLINE_END:
+                as.label(label_name("end_label", inline_labels.top()));
+                if (inline_stack.top() > stack_index){
+                    as.ins(I_ADD, wide_opd(ESP), imm_opd(inline_stack.top() - stack_index));
+                }
+                stack_index = inline_stack.top();
+                push_value();
+                inline_labels.pop();
+                inline_stack.pop();
+                current++;
+                break;
+
+            case O_BR:
+                size_dv.push(decl_vars.size());
+                current++;
+                break;
+
+            case C_BR:
+                while (decl_vars.size() > size_dv.top()){
+                    decl_vars.erase(decl_vars.begin() + decl_vars.size() - 1);
+                }
+                size_dv.pop();
+                current++;
+                break;
+
+            case VARDECL:
+                check_redefinition(ast[current].check_var_name(), decl_vars, size_dv.top());
+                // Variable without an initializer starts as 0, one with it gets its value right away.
+                if (ast[current].check_reg() >= 0){
+                    decl_vars.emplace_back(ast[current].check_var_name(), 1);     // in register, 1 is never an offset
+                    if (ast[current].check_inum() == 0){
+                        as.ins(I_MOV, reg_opd(var_regs[ast[current].check_reg()]), imm_opd(0));
+                    }
+                    current++;
+                    break;
+                }
+                decl_vars.emplace_back(ast[current].check_var_name(), func_slot(func_saved, ast[current].check_slot()));
+                if (ast[current].check_inum() == 0){
+                    as.ins(I_MOV, frame(decl_vars.back().second), imm_opd(0));
+                }
+                current++;
+                break;
+
+            case VARASSIGN:
+                if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
+                    *diag << "Variable is not defined1" << std::endl;
+                    throw compile_error_t();
+                }
+                as.ins(I_POP, wide_opd(EAX));
+                stack_index += word;
+                if (ast[current].check_reg() >= 0){
+                    as.ins(I_MOV, reg_opd(var_regs[ast[current].check_reg()]), reg_opd(EAX));
+                    current++;
+                    break;
+                }
+                as.ins(I_MOV, frame(find_var(ast[current].check_var_name(), decl_vars).first), reg_opd(EAX));
+                current++;
+                break;
+
+            case VARREF:
+                if (find_var(ast[current].check_var_name(), decl_vars).first == 0){
+                    *diag << "Variable is not defined2" << std::endl;
+                    throw compile_error_t();
+                }
+                // Value of assignment statement is not needed.
+                if (current + 1 < ast.size() && ast[current + 1].check_type() == EXPR_END){
+                    current += 2;
+                    break;
+                }
+                current = selector.select(ast, current, decl_vars, flags);
+                break;
+
+            case EXPR_END:          // value of expression statement is dropped.
+                as.ins(I_ADD, wide_opd(ESP), imm_opd(word));
+                stack_index += word;
+                current++;
+                break;
+
+            case FUNC_PARAMS:       // end of function body, return 0 if there was no return.
+                as.ins(I_MOV, reg_opd(EAX), imm_opd(0));
+                epilogue(as, func_saved, stack_index, frame_pointer);
+                as.ins(I_RET);
+                current++;
+                break;
+
+            case FUNC_DECL:
+                temp = current + 1;
+                while (temp < ast.size() && ast[temp].check_type() == VARDECL){
+                    temp++;
+                }
+                if (temp >= ast.size() || ast[temp].check_type() != O_BR){     // declaration without body
+                    current = temp;
+                    break;
+                }
+
+                /*
+                 * Frame: saved registers of variables (they are callee-saved), then stack slots
+                 * of variables, allocated at once. Function which calls nothing doesn't
+                 * set EBP, its frame is addressed from ESP.
+                 */
+                func_name = ast[current].check_func_name();
+                label = 0;
+                func_saved = 0;
+                temp_slots = 0;
+                frame_pointer = false;
+                for (size_t node = current + 1; ast[node].check_type() != FUNC_PARAMS; node++){
+                    int type = ast[node].check_type();
+                    if (type != FUNC_CALL && type != CALL_BEGIN){
+                        func_saved = std::max(func_saved, (size_t)(ast[node].check_reg() + 1));
+                    }
+                    temp_slots = std::max(temp_slots, (size_t)(ast[node].check_slot() + 1));
+                    frame_pointer = frame_pointer || ast[node].check_type() == FUNC_CALL;
+                }
+                stack_index = -word - word * (long int)func_saved;
+
+                as.function(ast[current].check_func_name());
+                if (frame_pointer){
+                    as.ins(I_PUSH, wide_opd(EBP));                      //save old value of frame pointer
+                    as.ins(I_MOV, wide_opd(EBP), wide_opd(ESP));        //current top of stack is bottom of new stack frame
+                }
+                for (size_t reg = 0; reg < func_saved; reg++){
+                    as.ins(I_PUSH, wide_opd(var_regs[reg]));
+                }
+                if (temp_slots > 0){
+                    as.ins(I_SUB, wide_opd(ESP), imm_opd(word * (long int)temp_slots));
+                    stack_index -= word * (long int)temp_slots;
+                }
+
+                // Parameters in registers are kept in the frame, the rest are above return address and old EBP.
+                decl_vars.clear();
+                func_homes.clear();
+                for (size_t param = current + 1; param < temp; param++){
+                    int index = param - current - 1;
+                    int reg = ast[param].check_reg();
+                    long int offset = (frame_pointer ? 2 * word : word) + word * (index - reg_args_num);
+                    if (index < reg_args_num && reg < 0){
+                        offset = func_slot(func_saved, ast[param].check_slot());
+                        as.ins(I_MOV, frame(offset), reg_opd(arg_regs[index]));
+                    }
+                    if (reg >= 0){
+                        if (index < reg_args_num){
+                            as.ins(I_MOV, reg_opd(var_regs[reg]), reg_opd(arg_regs[index]));
+                        } else {
+                            as.ins(I_MOV, reg_opd(var_regs[reg]), frame(offset));
+                        }
+                        offset = 1;             // in register, 1 is never an offset
+                    }
+                    decl_vars.emplace_back(ast[param].check_var_name(), offset);
+                    func_homes.emplace_back(reg, offset);
+                }
+                as.label(label_name("label", label));  // tail calls to itself jump here
+                func_params = temp - current - 1;
+                func_label = label;
+                label++;
+                current = temp;
+                break;
+
+            /*
+             * Each loop takes three labels: start (base), continue target (base + 1) and exit (base + 2).
+             * Statements leave nothing on the stack, so ESP is the same wherever paths join.
+             */
+            case WHILE_LABEL:
+                as.label(label_name("label", label));
+                loops.push(label);
+                current++;
+                label += 3;
+                break;
+
+            case WHILE_NEXT:
+                as.label(label_name("label", loops.top() + 1));
+                current++;
+                break;
+
+            case WHILE_EXPR:
+                as.jcc(negate_cc(condition()), label_name("label", loops.top() + 2));
+                current++;
+                break;
+
+            case WHILE_END:
+                as.ins(I_JMP, label_opd(label_name("label", loops.top())));
+                as.label(label_name("label", loops.top() + 2));
+                loops.pop();
+                current++;
+                break;
+
+            case NEXT:          // continue
+                if (loops.empty()){
+                    *diag << "Continue is not in a loop" << std::endl;
+                    throw compile_error_t();
+                }
+                as.ins(I_JMP, label_opd(label_name("label", loops.top() + 1)));
+                current++;
+                break;
+
+            case SKIP:          // break
+                if (loops.empty()){
+                    *diag << "Break is not in a loop" << std::endl;
+                    throw compile_error_t();
+                }
+                as.ins(I_JMP, label_opd(label_name("label", loops.top() + 2)));
+                current++;
+                break;
+
+            case SHORT_CIRC:        // && and ||, skip right operand if left one decides the result
+                if (ast[current].check_op() == "&&"){
+                    as.jcc(negate_cc(condition()), label_name("label", label));     // e1 is 0, so result is 0
+                } else {
+                    as.jcc(condition(), label_name("label", label));                // e1 is not 0, so result is 1
+                }
+                labels.push(label);
+                current++;
+                label++;
+                break;
+
+            case COND_QUEST:        // ternary
+                as.jcc(negate_cc(condition()), label_name("label", label));
+                cond_stack.push(stack_index);
+                labels.push(label);
+                current++;
+                label++;
+                break;
+
+            case COND_COLON:        // ternary
+                stack_index = cond_stack.top();     // only one of the arms pushes its value.
+                as.ins(I_JMP, label_opd(label_name("label", label)));
+                as.label(label_name("label", labels.top()));
+                labels.pop();
+                labels.push(label);
+                label++;
+                current++;
+                break;
+
+            case COND_END:          // ternary
+                as.label(label_name("label", labels.top()));
+                labels.pop();
+                cond_stack.pop();
+                label++;
+                current++;
+                break;
+
+            case IF_ELSE:
+                as.jcc(negate_cc(condition()), label_name("label", label));     // if e1 is false execute e3
+                labels.push(label);
+                current++;
+                label++;
+                break;
+
+            case IF_BODY:
+                as.ins(I_JMP, label_opd(label_name("label", label)));      // jump over e3
+                as.label(label_name("label", labels.top()));
+                labels.pop();
+                labels.push(label);
+                label++;
+                current++;
+                break;
+
+            case IF_END:
+                as.label(label_name("label", labels.top()));  // we need this label to jump over e3
+                labels.pop();
+                label++;
+                current++;
+                break;
+
+            case CONSTANT:
+                current = selector.select(ast, current, decl_vars, flags);
+                break;
+
+            case RET:
+                epilogue(as, func_saved, stack_index, frame_pointer);
+                as.ins(I_RET);
+                if (ast[current - 1].check_type() == COND_END){
+                    stack_index += word;        // arms of conditional expression push their value
+                }
+                current++;
+                break;
+
+            /*
+             * Left operand of && and || was already tested by SHORT_CIRC, which jumps to label
+             * when it decides the result on its own (0 for &&, 1 for ||).
+             * Here only the right operand is left.
+             */
+            case BI_OP:
+                if (ast[current].check_op() == "||" || ast[current].check_op() == "&&"){
+                    int cc = condition();
+                    as.ins(I_MOV, reg_opd(EAX), imm_opd(0));   //zero out EAX
+                    as.setcc(cc);                               //set AL if e2 is true
+                    as.ins(I_JMP, label_opd(label_name("end_label", labels.top())));
+                    as.label(label_name("label", labels.top()));
+                    as.ins(I_MOV, reg_opd(EAX), imm_opd(ast[current].check_op() == "||" ? 1 : 0));
+                    as.label(label_name("end_label", labels.top()));
+                    push_value();
+                    labels.pop();
+                    current++;
+                    break;
+                }
+                current = selector.select(ast, current, decl_vars, flags);
+                break;
+
+            case UN_OP:
+                current = selector.select(ast, current, decl_vars, flags);
+                break;
+
+            default:
+                *diag << "Code generation ERROR";
+                throw compile_error_t();
+        }
+    }
+}
+
+// Function definition, for the inliner.
+struct func_info_t {
+    std::string name;
+    std::vector<std::string> params;
+    size_t body_start;              // O_BR of the body
+    size_t body_end;                // C_BR of the body
+    size_t calls;                   // number of call sites
+    bool recursive;
+    bool pure;                      // no side effects
+    bool finite;                    // always returns: no loops and no recursion
+};
+
+static std::vector<func_info_t> collect_functions(std::vector<AST>& ast){
+    std::vector<func_info_t> functions;
+    for (size_t i = 0; i < ast.size(); i++){
+        if (ast[i].check_type() != FUNC_DECL) continue;
+        func_info_t func;
+        func.name = ast[i].check_func_name();
+        size_t j = i + 1;
+        while (j < ast.size() && ast[j].check_type() == VARDECL){
+            func.params.emplace_back(ast[j].check_var_name());
+            j++;
+        }
+        if (j >= ast.size() || ast[j].check_type() != O_BR) continue;     // declaration without body
+        func.body_start = j;
+        while (ast[j].check_type() != FUNC_PARAMS) j++;
+        func.body_end = j - 1;
+        func.calls = 0;
+        func.recursive = false;
+        func.pure = false;
+        func.finite = false;
+        functions.emplace_back(func);
+        i = j;
+    }
+    return functions;
+}
+
+static func_info_t* find_function(std::vector<func_info_t>& functions, const std::string& name){
+    report.lookups++;
+    for (func_info_t& func : functions){
+        if (func.name == name) return &func;
+    }
+    return nullptr;
+}
+
+// Calls made directly from body of the function.
+static std::vector<std::string> callees(std::vector<AST>& ast, const func_info_t& func){
+    std::vector<std::string> result;
+    for (size_t i = func.body_start; i <= func.body_end; i++){
+        if (ast[i].check_type() == FUNC_CALL && !find_str_vec(ast[i].check_func_name(), result)){
+            result.emplace_back(ast[i].check_func_name());
+        }
+    }
+    return result;
+}
+
+// Recursion guard: function is recursive if it can reach itself through calls.
+static void mark_recursive(std::vector<AST>& ast, std::vector<func_info_t>& functions){
+    std::vector<std::vector<std::string>> graph;
+    for (func_info_t& func : functions){
+        graph.emplace_back(callees(ast, func));
+    }
+    for (size_t f = 0; f < functions.size(); f++){
+        std::vector<std::string> visited;
+        std::vector<std::string> work = graph[f];
+        while (!work.empty() && !functions[f].recursive){
+            std::string name = work.back();
+            work.pop_back();
+            if (name == functions[f].name){
+                functions[f].recursive = true;
+            }
+            if (find_str_vec(name, visited)) continue;
+            visited.emplace_back(name);
+            for (size_t g = 0; g < functions.size(); g++){
+                if (functions[g].name == name){
+                    work.insert(work.end(), graph[g].begin(), graph[g].end());
+                }
+            }
+        }
+    }
+}
+
+// Body of the function for a call site: variables renamed, return jumps to the end.
+static std::vector<AST> inline_body(std::vector<AST>& ast, const func_info_t& func, int args, size_t instance){
+    const std::string prefix = "$" + std::to_string(instance) + "_";   // can't clash with identifiers.
+    std::vector<AST> result;
+
+    AST node_begin;
+    node_begin.set_type(INLINE_BEGIN);
+    node_begin.set_func_name(func.name);
+    node_begin.set_inum(args);
+    result.emplace_back(node_begin);
+
+    AST o_node;
+    o_node.set_type(O_BR);
+    result.emplace_back(o_node);
+    for (size_t param = 0; param < func.params.size(); param++){
+        AST node_bind;
+        node_bind.set_type(ARG_BIND);
+        node_bind.set_var_name(prefix + func.params[param]);
+        node_bind.set_inum(param);      // first argument is on top
+        result.emplace_back(node_bind);
+    }
+
+    for (size_t i = func.body_start; i <= func.body_end; i++){
+        AST node = ast[i];
+        if (node.check_type() == VARDECL || node.check_type() == VARREF ||
+            node.check_type() == VARASSIGN || node.check_type() == ARG_BIND){
+            node.set_var_name(prefix + node.check_var_name());
+        }
+        if (node.check_type() == RET){
+            node.set_type(INLINE_RET);
+        }
+        if (i == func.body_end && ast[i - 1].check_type() != RET){     // no return at the end: return 0
+            AST node_const;
+            node_const.set_type(CONSTANT);
+            node_const.set_inum(0);
+            result.emplace_back(node_const);
+            AST node_ret;
+            node_ret.set_type(INLINE_RET);
+            result.emplace_back(node_ret);
+        }
+        result.emplace_back(node);
+    }
+
+    AST c_node;
+    c_node.set_type(C_BR);
+    result.emplace_back(c_node);
+    AST node_end;
+    node_end.set_type(INLINE_END);
+    result.emplace_back(node_end);
+    return result;
+}
+
+void inline_calls(std::vector<AST>& ast){
+    const size_t max_rounds = 4;        // bodies with calls are inlined again, up to this depth.
+    size_t instance = 0;
+
+    for (size_t round = 0; round < max_rounds; round++){
+        std::vector<func_info_t> functions = collect_functions(ast);
+        mark_recursive(ast, functions);
+        for (AST& node : ast){
+            if (node.check_type() == FUNC_CALL){
+                func_info_t* callee = find_function(functions, node.check_func_name());
+                if (callee) callee->calls++;
+            }
+        }
+
+        std::vector<AST> result;
+        bool changed = false;
+        for (size_t i = 0; i < ast.size(); i++){
+            if (ast[i].check_type() == FUNC_CALL){
+                func_info_t* callee = find_function(functions, ast[i].check_func_name());
+                if (callee && !callee->recursive && callee->name != "main" &&
+                    callee->params.size() == (size_t)ast[i].check_inum()){
+                    size_t size = callee->body_end - callee->body_start + 1;
+                    if (size <= inline_threshold || (callee->calls == 1 && size <= 8 * inline_threshold)){
+                        // Arguments stay on the stack, no alignment for the call.
+                        int depth = 0;
+                        for (size_t k = result.size(); k-- > 0;){
+                            if (result[k].check_type() == FUNC_CALL) depth++;
+                            if (result[k].check_type() == CALL_BEGIN && depth-- == 0){
+                                result.erase(result.begin() + k);
+                                break;
+                            }
+                        }
+                        std::vector<AST> body = inline_body(ast, *callee, ast[i].check_inum(), instance++);
+                        result.insert(result.end(), body.begin(), body.end());
+                        changed = true;
+                        continue;
+                    }
+                }
+            }
+            result.emplace_back(ast[i]);
+        }
+        ast = result;
+        if (!changed) break;
+    }
+}
+
+// Purity: every function is assumed pure until a call shows otherwise, so recursion keeps it.
+static void mark_pure(std::vector<AST>& ast, std::vector<func_info_t>& functions){
+    mark_recursive(ast, functions);
+    for (func_info_t& func : functions){
+        func.pure = true;
+        func.finite = !func.recursive;
+        for (size_t i = func.body_start; i <= func.body_end; i++){
+            if (ast[i].check_type() == WHILE_LABEL) func.finite = false;
+        }
+    }
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (func_info_t& func : functions){
+            for (const std::string& name : callees(ast, func)){
+                func_info_t* callee = find_function(functions, name);
+                bool pure = func.pure && callee && callee->pure;
+                bool finite = func.finite && callee && callee->finite;
+                if (pure != func.pure || finite != func.finite){
+                    func.pure = pure;
+                    func.finite = finite;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void callgraph(std::vector<AST>& ast){
+    std::vector<func_info_t> functions = collect_functions(ast);
+    mark_pure(ast, functions);
+    std::vector<bool> removed(ast.size(), false);
+
+    // Functions reachable from main. Without main it is a library, nothing is removed.
+    if (find_function(functions, "main")){
+        std::vector<std::string> reachable(1, "main");
+        for (size_t k = 0; k < reachable.size(); k++){
+            func_info_t* func = find_function(functions, reachable[k]);
+            if (!func) continue;
+            for (const std::string& name : callees(ast, *func)){
+                if (!find_str_vec(name, reachable)) reachable.emplace_back(name);
+            }
+        }
+        for (const func_info_t& func : functions){
+            if (find_str_vec(func.name, reachable)) continue;
+            // From FUNC_DECL to FUNC_PARAMS.
+            for (size_t i = func.body_start - func.params.size() - 1; i <= func.body_end + 1; i++){
+                removed[i] = true;
+            }
+        }
+    }
+
+    // Call statements of pure functions whose arguments are simple expressions.
+    for (size_t i = 0; i + 1 < ast.size(); i++){
+        if (ast[i].check_type() != FUNC_CALL || ast[i + 1].check_type() != EXPR_END) continue;
+        func_info_t* callee = find_function(functions, ast[i].check_func_name());
+        if (!callee || !callee->pure || !callee->finite || callee->params.size() != (size_t)ast[i].check_inum()) continue;
+        size_t k = i;
+        while (k-- > 0){
+            int type = ast[k].check_type();
+            if (type != CONSTANT && type != VARREF && type != UN_OP && type != BI_OP) break;
+        }
+        if (ast[k].check_type() != CALL_BEGIN) continue;
+        for (size_t j = k; j <= i + 1; j++){
+            removed[j] = true;
+        }
+    }
+
+    std::vector<AST> result;
+    for (size_t i = 0; i < ast.size(); i++){
+        if (!removed[i]) result.emplace_back(ast[i]);
+    }
+    ast = result;
+
+    // Arguments of each call passed in registers, by the convention of its callee.
+    std::stack<size_t> begins;
+    for (size_t i = 0; i < ast.size(); i++){
+        if (ast[i].check_type() == CALL_BEGIN) begins.push(i);
+        if (ast[i].check_type() != FUNC_CALL) continue;
+        int regs = find_function(functions, ast[i].check_func_name()) ? reg_args_num : external_reg_args;
+        regs = std::min(regs, ast[i].check_inum());
+        ast[i].set_reg(regs);
+        ast[begins.top()].set_reg(regs);
+        begins.pop();
+    }
+}
+
+// Counted loop from FOR: for (var = first; var op bound; var = var + step).
+struct unroll_loop_t {
+    size_t body;            // first node of the body
+    size_t next;            // WHILE_NEXT, the step follows it
+    std::string var;
+    std::string op;         // <, <=, > or >=
+    int step;               // positive for < and <=, negative for > and >=
+    bool const_bound;
+    int bound;
+    std::string bound_var;  // if bound is not a constant
+    bool const_first;       // constant is assigned to var right before the loop
+    int first;
+};
+
+// Recognizes counted loop ast[label..end] whose body doesn't change var or bound and doesn't jump out.
+static bool counted_loop(std::vector<AST>& ast, size_t label, size_t end, unroll_loop_t& loop){
+    if (end < label + 11 || ast[label + 1].check_type() != VARREF) return false;
+    loop.var = ast[label + 1].check_var_name();
+
+    // Condition.
+    size_t cmp = const_operand(ast, label + 2, loop.bound);
+    loop.const_bound = ast[label + 2].check_type() == CONSTANT;
+    if (!loop.const_bound){
+        if (ast[label + 2].check_type() != VARREF || ast[label + 2].check_var_name() == loop.var) return false;
+        loop.bound_var = ast[label + 2].check_var_name();
+        cmp = label + 3;
+    }
+    loop.op = ast[cmp].check_op();
+    if (ast[cmp].check_type() != BI_OP || ast[cmp + 1].check_type() != WHILE_EXPR ||
+        (loop.op != "<" && loop.op != "<=" && loop.op != ">" && loop.op != ">=")) return false;
+    loop.body = cmp + 2;
+
+    // Step: var = var + constant, as an expression statement.
+    loop.next = end - 7;
+    if (loop.next < loop.body || ast[loop.next].check_type() != WHILE_NEXT ||
+        ast[end - 6].check_type() != VARREF || ast[end - 6].check_var_name() != loop.var ||
+        ast[end - 5].check_type() != CONSTANT || ast[end - 4].check_type() != BI_OP ||
+        ast[end - 3].check_type() != VARASSIGN || ast[end - 3].check_var_name() != loop.var ||
+        ast[end - 2].check_type() != VARREF || ast[end - 2].check_var_name() != loop.var ||
+        ast[end - 1].check_type() != EXPR_END) return false;
+    loop.step = ast[end - 5].check_inum();
+    if (ast[end - 4].check_op() == "-") loop.step = -loop.step;
+    else if (ast[end - 4].check_op() != "+") return false;
+    bool up = loop.op == "<" || loop.op == "<=";
+    if (loop.step == 0 || loop.step == INT_MIN || (loop.step > 0) != up) return false;
+
+    // Body.
+    int depth = 0;
+    for (size_t i = loop.body; i < loop.next; i++){
+        int type = ast[i].check_type();
+        if (type == WHILE_LABEL) depth++;
+        if (type == WHILE_END) depth--;
+        if ((type == NEXT || type == SKIP) && depth == 0) return false;
+        if ((type == VARASSIGN || type == VARDECL || type == ARG_BIND) &&
+            (ast[i].check_var_name() == loop.var || ast[i].check_var_name() == loop.bound_var)) return false;
+    }
+
+    // Initial value.
+    loop.const_first = false;
+    size_t assign = label - 1;
+    if (label >= 3 && ast[assign].check_type() == EXPR_END &&
+        ast[assign - 1].check_type() == VARREF && ast[assign - 1].check_var_name() == loop.var) assign -= 2;
+    if (assign >= 2 && ast[assign].check_type() == VARASSIGN && ast[assign].check_var_name() == loop.var){
+        size_t k = assign - 1;
+        if (ast[k].check_type() == UN_OP) k--;
+        loop.const_first = ast[k].check_type() == CONSTANT && const_operand(ast, k, loop.first) == assign;
+    }
+    return true;
+}
+
+static AST unroll_node(int type, const std::string& name, int inum){
+    AST node;
+    node.set_type(type);
+    node.set_var_name(name);
+    node.set_inum(inum);
+    return node;
+}
+
+// Unrolls counted loop ast[label..end]. Returns number of nodes replacing it, 0 if loop is kept.
+static size_t unroll_loop(std::vector<AST>& ast, size_t label, size_t end, size_t& temps){
+    unroll_loop_t loop;
+    if (!counted_loop(ast, label, end, loop)) return 0;
+    long long body_size = loop.next - loop.body + 2;
+    long long step = loop.step;
+    std::vector<AST> result;
+
+    // Trip count is known: body repeated with var replaced by its value.
+    if (loop.const_first && loop.const_bound){
+        long long first = loop.first, bound = loop.bound, trips = 0;
+        if (loop.op == "<" && first < bound) trips = (bound - first + step - 1) / step;
+        if (loop.op == "<=" && first <= bound) trips = (bound - first) / step + 1;
+        if (loop.op == ">" && first > bound) trips = (first - bound - step - 1) / -step;
+        if (loop.op == ">=" && first >= bound) trips = (first - bound) / -step + 1;
+        long long last = first + trips * step;
+        if (last >= INT_MIN && last <= INT_MAX && trips * body_size <= (long long)unroll_budget){
+            for (long long k = 0; k < trips; k++){
+                result.emplace_back(unroll_node(O_BR, "", 0));
+                for (size_t i = loop.body; i < loop.next; i++){
+                    if (ast[i].check_type() == VARREF && ast[i].check_var_name() == loop.var){
+                        result.emplace_back(unroll_node(CONSTANT, "", (int)(first + k * step)));
+                    } else {
+                        result.emplace_back(ast[i]);
+                    }
+                }
+                result.emplace_back(unroll_node(C_BR, "", 0));
+            }
+            result.emplace_back(unroll_node(CONSTANT, "", (int)last));
+            result.emplace_back(unroll_node(VARASSIGN, loop.var, 0));
+            ast.erase(ast.begin() + label, ast.begin() + end + 1);
+            ast.insert(ast.begin() + label, result.begin(), result.end());
+            return result.size();
+        }
+    }
+
+    // Unrolled loop runs while factor more iterations remain, the original one does the rest.
+    long long factor = std::min(4LL, (long long)unroll_budget / (body_size + 4));
+    if (factor < 2) return 0;
+    long long ahead = (factor - 1) * step;              // var + ahead must still pass the condition
+    AST limit;
+    if (loop.const_bound){
+        long long value = (long long)loop.bound - ahead;
+        if (value < INT_MIN || value > INT_MAX) return 0;
+        limit = unroll_node(CONSTANT, "", (int)value);
+    } else {
+        // Limit is bound - ahead, or nothing passes it if that overflows.
+        std::string name = "$unroll" + std::to_string(temps++);     // can't clash with identifiers.
+        bool up = step > 0;
+        AST node_op = unroll_node(BI_OP, "", 0);
+        node_op.set_op(up ? "-" : "+");
+        AST node_cmp = unroll_node(BI_OP, "", 0);
+        node_cmp.set_op(up ? ">" : "<");
+        result.emplace_back(unroll_node(VARDECL, name, 1));
+        result.emplace_back(unroll_node(VARREF, loop.bound_var, 0));
+        result.emplace_back(unroll_node(CONSTANT, "", (int)(up ? ahead : -ahead)));
+        result.emplace_back(node_op);
+        result.emplace_back(unroll_node(VARASSIGN, name, 0));
+        result.emplace_back(unroll_node(VARREF, name, 0));
+        result.emplace_back(unroll_node(VARREF, loop.bound_var, 0));
+        result.emplace_back(node_cmp);
+        result.emplace_back(unroll_node(IF_ELSE, "", 0));
+        result.emplace_back(unroll_node(CONSTANT, "", up ? INT_MIN : INT_MAX));
+        result.emplace_back(unroll_node(VARASSIGN, name, 0));
+        result.emplace_back(unroll_node(IF_BODY, "", 0));
+        result.emplace_back(unroll_node(IF_END, "", 0));
+        limit = unroll_node(VARREF, name, 0);
+    }
+    AST node_cmp = unroll_node(BI_OP, "", 0);
+    node_cmp.set_op(loop.op);
+    result.emplace_back(unroll_node(WHILE_LABEL, "", 0));
+    result.emplace_back(unroll_node(WHILE_NEXT, "", 0));
+    result.emplace_back(unroll_node(VARREF, loop.var, 0));
+    result.emplace_back(limit);
+    result.emplace_back(node_cmp);
+    result.emplace_back(unroll_node(WHILE_EXPR, "", 0));
+    for (long long k = 0; k < factor; k++){
+        result.emplace_back(unroll_node(O_BR, "", 0));
+        result.insert(result.end(), ast.begin() + loop.body, ast.begin() + loop.next);
+        result.emplace_back(unroll_node(C_BR, "", 0));
+        result.insert(result.end(), ast.begin() + end - 6, ast.begin() + end - 2);     // step without its value
+    }
+    result.emplace_back(unroll_node(WHILE_END, "", 0));
+    result.insert(result.end(), ast.begin() + label, ast.begin() + end + 1);
+    ast.erase(ast.begin() + label, ast.begin() + end + 1);
+    ast.insert(ast.begin() + label, result.begin(), result.end());
+    return result.size();
+}
+
+void unroll(std::vector<AST>& ast){
+    size_t temps = 0;
+    std::stack<size_t> loops;
+    // Inner loops first. Loops made by unrolling are not visited again.
+    for (size_t i = 0; i < ast.size(); i++){
+        if (ast[i].check_type() == WHILE_LABEL){
+            loops.push(i);
+        }
+        if (ast[i].check_type() == WHILE_END){
+            size_t label = loops.top();
+            loops.pop();
+            size_t size = unroll_loop(ast, label, i, temps);
+            if (size > 0) i = label + size - 1;
+        }
+    }
+}
+
+// Value left on the stack by a part of the loop, for LICM.
+struct licm_value_t {
+    size_t start;       // first node of the expression
+    size_t end;         // last node of the expression (its root)
+    bool invariant;
+    bool worth;         // hoisting saves at least one operation
+};
+
+// Hoist invariant expressions out of loop ast[start..end]. Returns true if anything was moved.
+static bool licm_loop(std::vector<AST>& ast, size_t start, size_t end, size_t& temps){
+    // Everything assigned or declared in the loop may change between iterations.
+    std::vector<std::string> written;
+    for (size_t i = start + 1; i < end; i++){
+        if (ast[i].check_type() == VARASSIGN || ast[i].check_type() == VARDECL || ast[i].check_type() == ARG_BIND){
+            written.emplace_back(ast[i].check_var_name());
+        }
+    }
+
+    std::vector<licm_value_t> values;
+    std::vector<licm_value_t> hoisted;      // maximal invariant expressions, in order.
+    // Value is used by something that stays in the loop.
+    auto consume = [&](){
+        if (values.empty()) return licm_value_t{0, 0, false, false};
+        licm_value_t value = values.back();
+        values.pop_back();
+        if (value.invariant && value.worth) hoisted.emplace_back(value);
+        return value;
+    };
+
+    for (size_t i = start + 1; i < end; i++){
+        switch (ast[i].check_type()){
+            case CONSTANT:
+                values.push_back({i, i, true, false});
+                break;
+
+            case VARREF:
+                values.push_back({i, i, !find_str_vec(ast[i].check_var_name(), written), false});
+                break;
+
+            case UN_OP:
+                if (!values.empty() && values.back().invariant){
+                    values.back().end = i;
+                    values.back().worth = values.back().worth || ast[values.back().start].check_type() == VARREF;
+                } else {
+                    consume();
+                    values.push_back({i, i, false, false});
+                }
+                break;
+
+            case BI_OP:
+                if (ast[i].check_op() == "&&" || ast[i].check_op() == "||"){
+                    consume();
+                    values.push_back({i, i, false, false});
+                    break;
+                }
+                if (values.size() >= 2){
+                    licm_value_t right = values[values.size() - 1];
+                    licm_value_t left = values[values.size() - 2];
+                    bool invariant = left.invariant && right.invariant;
+                    // Division may trap, so it is moved only if divisor is a safe constant.
+                    if (ast[i].check_op() == "/"){
+                        int divisor;
+                        invariant = invariant && const_operand(ast, right.start, divisor) == i &&
+                                    divisor != 0 && divisor != -1;
+                    }
+                    if (invariant){
+                        values.pop_back();
+                        values.back() = {left.start, i, true, true};
+                        break;
+                    }
+                }
+                consume();
+                consume();
+                values.push_back({i, i, false, false});
+                break;
+
+            case FUNC_CALL:
+                for (int arg = 0; arg < ast[i].check_inum(); arg++){
+                    consume();
+                }
+                values.push_back({i, i, false, false});
+                break;
+
+            case INLINE_BEGIN:
+                for (int arg = 0; arg < ast[i].check_inum(); arg++){
+                    consume();
+                }
+                break;
+
+            case INLINE_END:
+                values.push_back({i, i, false, false});
+                break;
+
+            case COND_END:
+                consume();
+                values.push_back({i, i, false, false});
+                break;
+
+            case VARASSIGN:
+            case RET:
+            case INLINE_RET:
+            case WHILE_EXPR:
+            case IF_ELSE:
+            case COND_QUEST:
+            case COND_COLON:
+            case SHORT_CIRC:
+            case EXPR_END:
+                consume();
+                break;
+
+            default:
+                break;
+        }
+    }
+    if (hoisted.empty()) return false;
+
+    std::sort(hoisted.begin(), hoisted.end(),
+              [](const licm_value_t& a, const licm_value_t& b){ return a.start < b.start; });
+
+    std::vector<AST> result(ast.begin(), ast.begin() + start);
+    std::vector<std::string> names;
+    for (const licm_value_t& value : hoisted){
+        names.emplace_back("$licm" + std::to_string(temps++));      // can't clash with identifiers.
+        AST node_decl;
+        node_decl.set_type(VARDECL);
+        node_decl.set_var_name(names.back());
+        node_decl.set_inum(1);
+        result.emplace_back(node_decl);
+        result.insert(result.end(), ast.begin() + value.start, ast.begin() + value.end + 1);
+        AST node_assign;
+        node_assign.set_type(VARASSIGN);
+        node_assign.set_var_name(names.back());
+        result.emplace_back(node_assign);
+    }
+    size_t i = start;
+    for (size_t k = 0; k < hoisted.size(); k++){
+        result.insert(result.end(), ast.begin() + i, ast.begin() + hoisted[k].start);
+        AST node_ref;
+        node_ref.set_type(VARREF);
+        node_ref.set_var_name(names[k]);
+        result.emplace_back(node_ref);
+        i = hoisted[k].end + 1;
+    }
+    result.insert(result.end(), ast.begin() + i, ast.end());
+    ast = result;
+    return true;
+}
+
+void licm(std::vector<AST>& ast){
+    size_t temps = 0;
+    bool changed = true;
+    // Inner loops end first, so they are processed before the loops around them.
+    while (changed){
+        changed = false;
+        std::stack<size_t> loops;
+        for (size_t i = 0; i < ast.size() && !changed; i++){
+            if (ast[i].check_type() == WHILE_LABEL){
+                loops.push(i);
+            }
+            if (ast[i].check_type() == WHILE_END){
+                changed = licm_loop(ast, loops.top(), i, temps);
+                loops.pop();
+            }
+        }
+    }
+}
+
+// Basic block of a function body, for data flow analyses.
+struct block_t {
+    size_t first;                   // first node
+    size_t last;                    // last node
+    std::vector<size_t> succ;
+    std::vector<size_t> pred;
+    int idom;                       // immediate dominator, -1 if block is unreachable
+    std::vector<size_t> children;   // blocks it immediately dominates
+};
+
+// Control flow graph of function body ast[start..end]. Block 0 is the entry.
+static std::vector<block_t> build_cfg(std::vector<AST>& ast, size_t start, size_t end, std::vector<size_t>& block_of){
+    const size_t none = SIZE_MAX;
+    std::vector<size_t> target(end - start + 1, none);      // where jump at each node goes
+    std::stack<size_t> ifs, conds, shorts, loops;
+    std::stack<std::vector<size_t>> inline_rets, loop_exits, loop_nexts;
+    std::stack<size_t> loop_next;
+
+    for (size_t i = start; i <= end; i++){
+        switch (ast[i].check_type()){
+            case IF_ELSE:       ifs.push(i); break;
+            case IF_BODY:       target[ifs.top() - start] = i + 1; ifs.pop(); ifs.push(i); break;
+            case IF_END:        target[ifs.top() - start] = i; ifs.pop(); break;
+            case COND_QUEST:    conds.push(i); break;
+            case COND_COLON:    target[conds.top() - start] = i + 1; conds.pop(); conds.push(i); break;
+            case COND_END:      target[conds.top() - start] = i; conds.pop(); break;
+            case SHORT_CIRC:    shorts.push(i); break;
+            case BI_OP:
+                if (ast[i].check_op() == "&&" || ast[i].check_op() == "||"){
+                    target[shorts.top() - start] = i;
+                    shorts.pop();
+                }
+                break;
+            case INLINE_BEGIN:  inline_rets.push({}); break;
+            case INLINE_RET:    inline_rets.top().emplace_back(i); break;
+            case INLINE_END:
+                for (size_t ret : inline_rets.top()) target[ret - start] = i;
+                inline_rets.pop();
+                break;
+            case WHILE_LABEL:
+                loops.push(i);
+                loop_next.push(i);
+                loop_exits.push({});
+                loop_nexts.push({});
+                break;
+            case WHILE_NEXT:    loop_next.top() = i; break;
+            case WHILE_EXPR:
+            case SKIP:          loop_exits.top().emplace_back(i); break;
+            case NEXT:          loop_nexts.top().emplace_back(i); break;
+            case WHILE_END:
+                target[i - start] = loops.top();
+                for (size_t exit : loop_exits.top()) target[exit - start] = i + 1;
+                for (size_t next : loop_nexts.top()) target[next - start] = loop_next.top();
+                loops.pop();
+                loop_next.pop();
+                loop_exits.pop();
+                loop_nexts.pop();
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Blocks start at jump targets and after jumps.
+    std::vector<bool> leader(end - start + 2, false);
+    leader[0] = true;
+    for (size_t i = start; i <= end; i++){
+        if (target[i - start] != none){
+            leader[target[i - start] - start] = true;
+            leader[i - start + 1] = true;
+        }
+        if (ast[i].check_type() == RET) leader[i - start + 1] = true;
+    }
+    std::vector<block_t> blocks;
+    block_of.assign(end - start + 1, 0);
+    for (size_t i = start; i <= end; i++){
+        if (leader[i - start]){
+            blocks.push_back({i, i, {}, {}, -1, {}});
+        }
+        blocks.back().last = i;
+        block_of[i - start] = blocks.size() - 1;
+    }
+
+    for (size_t b = 0; b < blocks.size(); b++){
+        size_t last = blocks[b].last;
+        int type = ast[last].check_type();
+        bool falls = type != RET && type != IF_BODY && type != COND_COLON && type != WHILE_END &&
+                     type != NEXT && type != SKIP && type != INLINE_RET;
+        if (falls && last < end){
+            blocks[b].succ.emplace_back(block_of[last + 1 - start]);
+        }
+        if (target[last - start] != none){
+            blocks[b].succ.emplace_back(block_of[target[last - start] - start]);
+        }
+        for (size_t succ : blocks[b].succ){
+            blocks[succ].pred.emplace_back(b);
+        }
+    }
+    return blocks;
+}
+
+// Immediate dominators (Cooper, Harvey, Kennedy). Returns reachable blocks in reverse postorder.
+static std::vector<size_t> dominators(std::vector<block_t>& blocks){
+    std::vector<size_t> order;                          // postorder
+    std::vector<int> visited(blocks.size(), 0);
+    std::vector<std::pair<size_t, size_t>> work = {{0, 0}};
+    visited[0] = 1;
+    while (!work.empty()){
+        size_t b = work.back().first;
+        size_t& next = work.back().second;
+        if (next < blocks[b].succ.size()){
+            size_t succ = blocks[b].succ[next++];
+            if (!visited[succ]){
+                visited[succ] = 1;
+                work.emplace_back(succ, 0);
+            }
+        } else {
+            order.emplace_back(b);
+            work.pop_back();
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    std::vector<size_t> rpo(blocks.size(), 0);
+    for (size_t i = 0; i < order.size(); i++) rpo[order[i]] = i;
+
+    blocks[0].idom = 0;
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++){
+            size_t b = order[i];
+            int idom = -1;
+            for (size_t pred : blocks[b].pred){
+                if (blocks[pred].idom == -1) continue;
+                if (idom == -1){
+                    idom = pred;
+                    continue;
+                }
+                size_t f1 = pred, f2 = idom;
+                while (f1 != f2){
+                    while (rpo[f1] > rpo[f2]) f1 = blocks[f1].idom;
+                    while (rpo[f2] > rpo[f1]) f2 = blocks[f2].idom;
+                }
+                idom = f1;
+            }
+            if (blocks[b].idom != idom){
+                blocks[b].idom = idom;
+                changed = true;
+            }
+        }
+    }
+    for (size_t i = 1; i < order.size(); i++){
+        blocks[blocks[order[i]].idom].children.emplace_back(order[i]);
+    }
+    return order;
+}
+
+// Phi function of variable at the start of a block.
+struct phi_t {
+    int decl;                       // variable
+    int value;                      // SSA value it defines
+    std::vector<int> args;          // SSA value coming from each predecessor
+};
+
+// SSA form of one function body.
+class SSA {
+public:
+    std::vector<AST>& ast;
+    size_t start, end;
+    std::vector<block_t> blocks;
+    std::vector<size_t> block_of;           // block of each node
+    std::vector<size_t> order;              // reachable blocks, reverse postorder
+    std::vector<int> decl_of;               // variable of each node, -1 if none
+    std::vector<bool> promotable;           // parameter or local variable declared by VARDECL
+    std::vector<std::vector<phi_t>> phis;   // by block
+    std::vector<int> value_decl;            // variable of each SSA value, value 0 is undefined
+
+    SSA(std::vector<AST>& nodes, size_t body_start, size_t body_end, const std::vector<std::string>& params)
+            : ast(nodes), start(body_start), end(body_end){
+        resolve(params);
+        blocks = build_cfg(ast, start, end, block_of);
+        order = dominators(blocks);
+        place_phis();
+        value_decl.emplace_back(-1);
+        std::vector<std::vector<int>> stacks(promotable.size(), std::vector<int>(1, 0));
+        for (size_t param = 0; param < params.size(); param++){      // values on entry
+            stacks[param].back() = value_decl.size();
+            value_decl.emplace_back(param);
+        }
+        rename(0, stacks);
+    }
+
+    bool is_def(size_t i){
+        return decl_of[i - start] >= 0 &&
+               (ast[i].check_type() == VARDECL || ast[i].check_type() == VARASSIGN || ast[i].check_type() == ARG_BIND);
+    }
+    bool is_use(size_t i){
+        return decl_of[i - start] >= 0 && ast[i].check_type() == VARREF;
+    }
+
+private:
+    // Declaration each variable name refers to, by the same scope rules as codegen.
+    void resolve(const std::vector<std::string>& params){
+        std::vector<std::string> scope;                         // names in order of declaration
+        std::map<std::string, std::vector<int>> visible;        // declarations of each name, innermost last
+        std::stack<size_t> scope_size;
+        auto declare = [&](const std::string& name, bool local){
+            scope.emplace_back(name);
+            visible[name].emplace_back(promotable.size());
+            promotable.push_back(local);
+        };
+        for (const std::string& param : params){
+            declare(param, true);
+        }
+        decl_of.assign(end - start + 1, -1);
+        for (size_t i = start; i <= end; i++){
+            switch (ast[i].check_type()){
+                case O_BR:
+                    scope_size.push(scope.size());
+                    break;
+                case C_BR:
+                    while (scope.size() > scope_size.top()){
+                        visible[scope.back()].pop_back();
+                        scope.pop_back();
+                    }
+                    scope_size.pop();
+                    break;
+                case VARDECL:
+                case ARG_BIND:
+                    decl_of[i - start] = promotable.size();
+                    declare(ast[i].check_var_name(), ast[i].check_type() == VARDECL);
+                    break;
+                case VARREF:
+                case VARASSIGN: {
+                    auto it = visible.find(ast[i].check_var_name());
+                    if (it != visible.end() && !it->second.empty()) decl_of[i - start] = it->second.back();
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Pruned SSA: phi only where variable is live, at the iterated dominance frontier of its definitions.
+    // Liveness is found per variable, walking back from the blocks that use it, so the cost follows live ranges.
+    void place_phis(){
+        size_t decls = promotable.size();
+        std::vector<std::vector<size_t>> def_blocks(decls), use_blocks(decls);
+        std::vector<size_t> defined(decls, SIZE_MAX), used(decls, SIZE_MAX);     // last block seen
+        for (size_t b = 0; b < blocks.size(); b++){
+            if (blocks[b].idom == -1) continue;
+            for (size_t i = blocks[b].first; i <= blocks[b].last; i++){
+                int decl = decl_of[i - start];
+                if (is_use(i) && defined[decl] != b && used[decl] != b){
+                    used[decl] = b;
+                    use_blocks[decl].emplace_back(b);
+                }
+                if (is_def(i) && defined[decl] != b){
+                    defined[decl] = b;
+                    def_blocks[decl].emplace_back(b);
+                }
+            }
+        }
+
+        std::vector<std::vector<size_t>> frontier(blocks.size());
+        for (size_t b : order){
+            if (blocks[b].pred.size() < 2) continue;
+            for (size_t pred : blocks[b].pred){
+                if (blocks[pred].idom == -1) continue;
+                size_t runner = pred;
+                while (runner != (size_t)blocks[b].idom){
+                    if (frontier[runner].empty() || frontier[runner].back() != b){
+                        frontier[runner].emplace_back(b);
+                    }
+                    runner = blocks[runner].idom;
+                }
+            }
+        }
+
+        phis.assign(blocks.size(), {});
+        std::vector<size_t> killed(blocks.size(), SIZE_MAX), live_in(blocks.size(), SIZE_MAX);
+        std::vector<size_t> has_phi(blocks.size(), SIZE_MAX), queued(blocks.size(), SIZE_MAX);
+        for (size_t decl = 0; decl < decls; decl++){
+            for (size_t b : def_blocks[decl]) killed[b] = decl;
+            std::vector<size_t> work = use_blocks[decl];
+            for (size_t b : work) live_in[b] = decl;
+            while (!work.empty()){
+                size_t b = work.back();
+                work.pop_back();
+                for (size_t pred : blocks[b].pred){
+                    if (live_in[pred] == decl || killed[pred] == decl || blocks[pred].idom == -1) continue;
+                    live_in[pred] = decl;
+                    work.emplace_back(pred);
+                }
+            }
+
+            work = def_blocks[decl];
+            for (size_t b : work) queued[b] = decl;
+            while (!work.empty()){
+                size_t b = work.back();
+                work.pop_back();
+                for (size_t join : frontier[b]){
+                    if (has_phi[join] == decl || live_in[join] != decl) continue;
+                    has_phi[join] = decl;
+                    phis[join].push_back({(int)decl, 0, std::vector<int>(blocks[join].pred.size(), 0)});
+                    if (queued[join] != decl){
+                        queued[join] = decl;
+                        work.emplace_back(join);
+                    }
+                }
+            }
+        }
+    }
+
+    // Numbers SSA values walking the dominator tree. Node's version is the value it reads or writes.
+    void rename(size_t b, std::vector<std::vector<int>>& stacks){
+        std::vector<int> pushed;
+        for (phi_t& phi : phis[b]){
+            phi.value = value_decl.size();
+            value_decl.emplace_back(phi.decl);
+            stacks[phi.decl].emplace_back(phi.value);
+            pushed.emplace_back(phi.decl);
+        }
+        for (size_t i = blocks[b].first; i <= blocks[b].last; i++){
+            if (is_use(i)){
+                ast[i].set_version(stacks[decl_of[i - start]].back());
+            }
+            if (is_def(i)){
+                int decl = decl_of[i - start];
+                ast[i].set_version(value_decl.size());
+                stacks[decl].emplace_back(value_decl.size());
+                value_decl.emplace_back(decl);
+                pushed.emplace_back(decl);
+            }
+        }
+        for (size_t succ : blocks[b].succ){
+            for (size_t k = 0; k < blocks[succ].pred.size(); k++){
+                if (blocks[succ].pred[k] != b) continue;
+                for (phi_t& phi : phis[succ]){
+                    phi.args[k] = stacks[phi.decl].back();
+                }
+            }
+        }
+        for (size_t child : blocks[b].children){
+            rename(child, stacks);
+        }
+        for (int decl : pushed){
+            stacks[decl].pop_back();
+        }
+    }
+};
+
+// Choose registers for the variables of one function.
+static void promote_function(std::vector<AST>& ast, const func_info_t& func){
+    SSA ssa(ast, func.body_start, func.body_end, func.params);
+    size_t decls = ssa.promotable.size();
+    size_t values = ssa.value_decl.size();
+    size_t start = ssa.start;
+    size_t blocks = ssa.blocks.size();
+
+    // Live SSA values at the start and the end of each block, found per value by walking back from its uses.
+    std::vector<size_t> def_block(values, SIZE_MAX);       // parameters are defined before the entry
+    std::vector<std::vector<size_t>> live_from(values), live_after(values);
+    for (size_t b : ssa.order){
+        for (phi_t& phi : ssa.phis[b]){
+            def_block[phi.value] = b;
+        }
+        for (size_t i = ssa.blocks[b].first; i <= ssa.blocks[b].last; i++){
+            if (ssa.is_def(i)) def_block[ast[i].check_version()] = b;
+        }
+    }
+    for (size_t b : ssa.order){
+        for (size_t i = ssa.blocks[b].first; i <= ssa.blocks[b].last; i++){
+            int value = ast[i].check_version();
+            if (ssa.is_use(i) && value != 0 && def_block[value] != b) live_from[value].emplace_back(b);
+        }
+        for (size_t p = 0; p < ssa.blocks[b].pred.size(); p++){
+            for (phi_t& phi : ssa.phis[b]){
+                if (phi.args[p] != 0) live_after[phi.args[p]].emplace_back(ssa.blocks[b].pred[p]);
+            }
+        }
+    }
+    std::vector<std::vector<int>> live_in(blocks), live_out(blocks);
+    std::vector<size_t> in_mark(blocks, SIZE_MAX), out_mark(blocks, SIZE_MAX);
+    for (size_t value = 1; value < values; value++){
+        std::vector<size_t>& work = live_from[value];
+        auto reach_end = [&](size_t b){
+            if (out_mark[b] == value) return;
+            out_mark[b] = value;
+            live_out[b].emplace_back(value);
+            if (def_block[value] != b) work.emplace_back(b);
+        };
+        for (size_t b : live_after[value]) reach_end(b);
+        while (!work.empty()){
+            size_t b = work.back();
+            work.pop_back();
+            if (in_mark[b] == value) continue;
+            in_mark[b] = value;
+            live_in[b].emplace_back(value);
+            for (size_t pred : ssa.blocks[b].pred){
+                if (ssa.blocks[pred].idom != -1) reach_end(pred);
+            }
+        }
+    }
+
+    // Two variables interfere if one is written while a value of the other is live.
+    std::vector<std::vector<int>> interfere(decls);
+    std::vector<int> live;
+    std::vector<size_t> position(values, SIZE_MAX);        // of each value in live
+    auto insert = [&](int value){
+        if (position[value] != SIZE_MAX) return;
+        position[value] = live.size();
+        live.emplace_back(value);
+    };
+    auto erase = [&](int value){
+        if (position[value] == SIZE_MAX) return;
+        live[position[value]] = live.back();
+        position[live.back()] = position[value];
+        live.pop_back();
+        position[value] = SIZE_MAX;
+    };
+    std::vector<size_t> compacted(decls, 0);                // size of each list when duplicates were last dropped
+    std::vector<int> seen(decls, -1);
+    auto compact = [&](int decl){
+        std::vector<int>& others = interfere[decl];
+        size_t kept = 0;
+        for (int other : others){
+            if (seen[other] == decl) continue;
+            seen[other] = decl;
+            others[kept++] = other;
+        }
+        others.resize(kept);
+        for (int other : others) seen[other] = -1;
+        compacted[decl] = kept;
+    };
+    auto connect = [&](int decl, int other){
+        interfere[decl].emplace_back(other);
+        if (interfere[decl].size() >= 2 * compacted[decl] + 64) compact(decl);
+    };
+    auto add_edges = [&](int value, const std::vector<int>& others){
+        int decl = ssa.value_decl[value];
+        for (int other : others){
+            int other_decl = ssa.value_decl[other];
+            if (other_decl != decl){
+                connect(decl, other_decl);
+                connect(other_decl, decl);
+            }
+        }
+    };
+    for (size_t b : ssa.order){
+        for (int value : live_out[b]) insert(value);
+        for (size_t i = ssa.blocks[b].last + 1; i-- > ssa.blocks[b].first;){
+            if (ssa.is_def(i)){
+                erase(ast[i].check_version());
+                add_edges(ast[i].check_version(), live);
+            }
+            if (ssa.is_use(i) && ast[i].check_version() != 0) insert(ast[i].check_version());
+        }
+        for (phi_t& phi : ssa.phis[b]){
+            insert(phi.value);
+        }
+        for (phi_t& phi : ssa.phis[b]){
+            add_edges(phi.value, live);
+        }
+        for (int value : live) position[value] = SIZE_MAX;
+        live.clear();
+    }
+    // Parameters are all defined on entry: each one is moved to its place there, even if it's dead.
+    for (int value : live_in[0]){
+        add_edges(value, live_in[0]);
+    }
+    for (size_t param = 0; param < func.params.size(); param++){
+        for (int other : live_in[0]){
+            int other_decl = ssa.value_decl[other];
+            if ((size_t)other_decl == param) continue;
+            connect(param, other_decl);
+            connect(other_decl, param);
+        }
+    }
+    for (size_t decl = 0; decl < decls; decl++){
+        compact(decl);
+    }
+
+    // Uses in loops weigh more.
+    std::vector<long> weight(decls, 0);
+    std::vector<bool> used(decls, false);
+    long depth_weight = 1;
+    std::stack<long> loop_weights;
+    for (size_t i = start; i <= ssa.end; i++){
+        if (ast[i].check_type() == WHILE_LABEL){
+            loop_weights.push(depth_weight);
+            depth_weight = std::min(depth_weight * 10, 1000000L);
+        }
+        if (ast[i].check_type() == WHILE_END){
+            depth_weight = loop_weights.top();
+            loop_weights.pop();
+        }
+        int decl = ssa.decl_of[i - start];
+        if (decl >= 0 && ssa.promotable[decl]){
+            weight[decl] += depth_weight;
+            if (ast[i].check_type() == VARREF) used[decl] = true;
+        }
+    }
+
+    std::vector<int> candidates;
+    for (size_t decl = 0; decl < decls; decl++){
+        if (ssa.promotable[decl] && used[decl]) candidates.emplace_back(decl);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [&](int a, int b){ return weight[a] > weight[b]; });
+    std::vector<int> reg(decls, -1);
+    for (int decl : candidates){
+        std::vector<bool> taken(var_regs_num, false);
+        for (int other : interfere[decl]){
+            if (reg[other] >= 0) taken[reg[other]] = true;
+        }
+        for (int r = 0; r < var_regs_num; r++){
+            if (!taken[r]){
+                reg[decl] = r;
+                break;
+            }
+        }
+    }
+
+    // Variables left in memory share stack slots the same way, except parameters passed on the stack.
+    std::vector<int> slot(decls, -1);
+    for (size_t decl = 0; decl < decls; decl++){
+        if (!ssa.promotable[decl] || reg[decl] >= 0 || (decl < func.params.size() && decl >= (size_t)reg_args_num)) continue;
+        std::vector<bool> taken;
+        for (int other : interfere[decl]){
+            if (slot[other] < 0) continue;
+            if ((size_t)slot[other] >= taken.size()) taken.resize(slot[other] + 1, false);
+            taken[slot[other]] = true;
+        }
+        slot[decl] = std::find(taken.begin(), taken.end(), false) - taken.begin();
+    }
+
+    for (size_t i = start; i <= ssa.end; i++){
+        int decl = ssa.decl_of[i - start];
+        if (decl >= 0 && ssa.promotable[decl]){
+            ast[i].set_reg(reg[decl]);
+            ast[i].set_slot(slot[decl]);
+        }
+    }
+    for (size_t param = 0; param < func.params.size(); param++){
+        ast[start - func.params.size() + param].set_reg(reg[param]);
+        ast[start - func.params.size() + param].set_slot(slot[param]);
+    }
+}
+
+void mem2reg(std::vector<AST>& ast){
+    for (const func_info_t& func : collect_functions(ast)){
+        promote_function(ast, func);
+    }
+}
+
+// Expression of a function body with its value number, for GVN.
+struct gvn_value_t {
+    size_t start;       // first node of the expression
+    size_t end;         // last node of the expression (its root)
+    int number;         // expressions with equal numbers have equal values
+    bool pure;          // only constants, variables and arithmetic
+    bool worth;         // computing it takes at least one binary operation
+};
+
+// Nodes ast[start..end) of the function are replaced with nodes (inserted if start == end).
+struct gvn_edit_t {
+    size_t start;
+    size_t end;
+    std::vector<AST> nodes;
+};
+
+// Value numbers of the expressions of a function, in order of their roots. Variables are
+// numbered by their SSA value, so assignment to an operand gives the expression a new number.
+// Calls and everything else except arithmetic get a number of their own.
+static std::vector<gvn_value_t> gvn_numbers(SSA& ssa){
+    std::vector<AST>& ast = ssa.ast;
+    std::map<std::string, int> numbers;
+    int fresh = 0;
+    auto number = [&](const std::string& key){
+        auto it = numbers.find(key);
+        if (it != numbers.end()) return it->second;
+        numbers[key] = fresh;
+        return fresh++;
+    };
+
+    std::vector<gvn_value_t> exprs, values;
+    auto pop = [&](){
+        if (values.empty()) return gvn_value_t{0, 0, fresh++, false, false};
+        gvn_value_t value = values.back();
+        values.pop_back();
+        return value;
+    };
+    auto push = [&](const gvn_value_t& value){
+        values.emplace_back(value);
+        if (value.pure && value.worth) exprs.emplace_back(value);
+    };
+
+    for (size_t i = ssa.start; i <= ssa.end; i++){
+        int decl = ssa.decl_of[i - ssa.start];
+        std::string op = ast[i].check_op();
+        switch (ast[i].check_type()){
+            case CONSTANT:
+                push({i, i, number("c" + std::to_string(ast[i].check_inum())), true, false});
+                break;
+
+            case VARREF:
+                if (decl >= 0){
+                    push({i, i, number("v" + std::to_string(decl) + "." + std::to_string(ast[i].check_version())), true, false});
+                } else {
+                    push({i, i, fresh++, false, false});
+                }
+                break;
+
+            case UN_OP: {
+                gvn_value_t operand = pop();
+                push({operand.start, i, number("u" + op + " " + std::to_string(operand.number)), operand.pure, operand.worth});
+                break;
+            }
+
+            case BI_OP: {
+                gvn_value_t right = pop();
+                if (op == "&&" || op == "||"){
+                    push({i, i, fresh++, false, false});
+                    break;
+                }
+                gvn_value_t left = pop();
+                int a = left.number, b = right.number;
+                if ((op == "+" || op == "*" || op == "==" || op == "!=") && a > b) std::swap(a, b);
+                push({left.start, i, number("b" + op + " " + std::to_string(a) + " " + std::to_string(b)),
+                      left.pure && right.pure, true});
+                break;
+            }
+
+            case FUNC_CALL:
+                for (int arg = 0; arg < ast[i].check_inum(); arg++){
+                    pop();
                 }
+                push({i, i, fresh++, false, false});
+                break;
 
-                if (ast[current].check_op() == "<="){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsetle al\n");          //set AL if SF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
-                    break;
+            case INLINE_BEGIN:
+                for (int arg = 0; arg < ast[i].check_inum(); arg++){
+                    pop();
                 }
+                break;
 
-                if (ast[current].check_op() == ">="){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, ecx\n");     //set ZF on if e1 == e2, set it off otherwise
-                    fprintf(pfile, "\tmov eax, 0\n");       //zero out EAX
-                    fprintf(pfile, "\tsetge al\n");          //set AL if SF is on
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
+            case INLINE_END:
+                push({i, i, fresh++, false, false});
+                break;
+
+            case COND_END:
+                pop();
+                push({i, i, fresh++, false, false});
+                break;
+
+            case VARASSIGN:
+            case RET:
+            case INLINE_RET:
+            case WHILE_EXPR:
+            case IF_ELSE:
+            case COND_QUEST:
+            case COND_COLON:
+            case SHORT_CIRC:
+            case EXPR_END:
+                pop();
+                break;
+
+            default:
+                break;
+        }
+    }
+    return exprs;
+}
+
+static AST gvn_node(int type, const std::string& name){
+    AST node;
+    node.set_type(type);
+    node.set_var_name(name);
+    return node;
+}
+
+// Applies edits sorted by position. Returns change of the number of nodes.
+static long gvn_apply(std::vector<AST>& ast, std::vector<gvn_edit_t>& edits){
+    std::stable_sort(edits.begin(), edits.end(), [](const gvn_edit_t& a, const gvn_edit_t& b){
+        if (a.start != b.start) return a.start < b.start;
+        return a.start == a.end && b.start != b.end;           // insertions go first
+    });
+    std::vector<AST> result;
+    size_t i = 0;
+    for (const gvn_edit_t& edit : edits){
+        result.insert(result.end(), ast.begin() + i, ast.begin() + edit.start);
+        result.insert(result.end(), edit.nodes.begin(), edit.nodes.end());
+        i = edit.end;
+    }
+    result.insert(result.end(), ast.begin() + i, ast.end());
+    long delta = (long)result.size() - (long)ast.size();
+    ast = result;
+    return delta;
+}
+
+// Numbers blocks in preorder of the dominator tree, last[b] is the last number below b.
+static void gvn_preorder(const std::vector<block_t>& blocks, size_t b, size_t& counter,
+                         std::vector<size_t>& pre, std::vector<size_t>& last){
+    pre[b] = counter++;
+    for (size_t child : blocks[b].children){
+        gvn_preorder(blocks, child, counter, pre, last);
+    }
+    last[b] = counter - 1;
+}
+
+// Expression computed at the start of both arms of an if is computed once, right before the jump.
+static long gvn_hoist(std::vector<AST>& ast, const func_info_t& func, size_t& temps){
+    SSA ssa(ast, func.body_start, func.body_end, func.params);
+    std::vector<gvn_value_t> exprs = gvn_numbers(ssa);
+    auto block = [&](size_t i){ return ssa.block_of[i - ssa.start]; };
+    std::vector<gvn_edit_t> edits;
+    std::stack<std::pair<size_t, size_t>> ifs;     // IF_ELSE and IF_BODY
+
+    // Expressions within one block, latest first.
+    std::vector<std::vector<size_t>> in_block(ssa.blocks.size());
+    for (size_t k = exprs.size(); k-- > 0;){
+        if (block(exprs[k].start) == block(exprs[k].end)) in_block[block(exprs[k].end)].emplace_back(k);
+    }
+
+    for (size_t i = ssa.start; i <= ssa.end; i++){
+        if (ast[i].check_type() == IF_ELSE) ifs.push({i, 0});
+        if (ast[i].check_type() == IF_BODY) ifs.top().second = i;
+        if (ast[i].check_type() != IF_END) continue;
+        size_t jump = ifs.top().first, body = ifs.top().second;
+        ifs.pop();
+        if (body + 1 == i) continue;                // no else
+        std::vector<gvn_value_t> taken_then, taken_else;
+        // Outer expressions first, their parts are not hoisted separately. In the else arm a match may
+        // also hold an expression taken before, expressions there don't come outer first.
+        auto overlaps = [](const gvn_value_t& value, const std::vector<gvn_value_t>& taken){
+            for (const gvn_value_t& other : taken){
+                if (value.start <= other.end && other.start <= value.end) return true;
+            }
+            return false;
+        };
+        std::map<int, std::vector<size_t>> in_else;                     // by value number
+        for (size_t b : in_block[block(body + 1)]){
+            in_else[exprs[b].number].emplace_back(b);
+        }
+        for (size_t a : in_block[block(jump + 1)]){
+            auto same = in_else.find(exprs[a].number);
+            if (same == in_else.end() || overlaps(exprs[a], taken_then)) continue;
+            for (size_t b : same->second){
+                if (overlaps(exprs[b], taken_else)) continue;
+                std::string name = "$gvn" + std::to_string(temps++);     // can't clash with identifiers.
+                edits.push_back({ssa.start + 1, ssa.start + 1, {gvn_node(VARDECL, name)}});
+                gvn_edit_t hoist = {jump, jump, std::vector<AST>(ast.begin() + exprs[a].start, ast.begin() + exprs[a].end + 1)};
+                hoist.nodes.emplace_back(gvn_node(VARASSIGN, name));
+                edits.emplace_back(hoist);
+                edits.push_back({exprs[a].start, exprs[a].end + 1, {gvn_node(VARREF, name)}});
+                edits.push_back({exprs[b].start, exprs[b].end + 1, {gvn_node(VARREF, name)}});
+                taken_then.emplace_back(exprs[a]);
+                taken_else.emplace_back(exprs[b]);
+                break;
+            }
+        }
+    }
+    return gvn_apply(ast, edits);
+}
+
+// Expression computed again where an earlier computation of it dominates takes its value instead.
+// Returns change of the number of nodes.
+static long gvn_reuse(std::vector<AST>& ast, const func_info_t& func, size_t& temps){
+    SSA ssa(ast, func.body_start, func.body_end, func.params);
+    std::vector<gvn_value_t> exprs = gvn_numbers(ssa);
+    auto block = [&](size_t i){ return ssa.block_of[i - ssa.start]; };
+    std::vector<size_t> pre(ssa.blocks.size(), SIZE_MAX), last(ssa.blocks.size(), 0);
+    size_t counter = 0;
+    gvn_preorder(ssa.blocks, 0, counter, pre, last);
+    auto dominates = [&](size_t a, size_t b){ return pre[a] <= pre[b] && pre[b] <= last[a]; };
+
+    // Available computations of each value; the first one dominating a use is its source.
+    std::map<int, std::vector<size_t>> available;
+    std::vector<long> source(exprs.size(), -1);
+    for (size_t k = 0; k < exprs.size(); k++){
+        size_t b = block(exprs[k].end);
+        if (pre[b] == SIZE_MAX) continue;       // unreachable
+        for (size_t s : available[exprs[k].number]){
+            if (dominates(block(exprs[s].end), b)){
+                source[k] = s;
+                break;
+            }
+        }
+        if (source[k] == -1) available[exprs[k].number].emplace_back(k);
+    }
+
+    // Only the outermost reused expressions are replaced, their sources must stay.
+    std::vector<size_t> replaced;
+    for (size_t k = exprs.size(); k-- > 0;){
+        if (source[k] == -1) continue;
+        if (!replaced.empty() && exprs[k].end >= exprs[replaced.back()].start) continue;
+        replaced.emplace_back(k);
+    }
+    if (replaced.empty()) return 0;
+    std::vector<std::string> names(exprs.size());
+    std::vector<gvn_edit_t> edits;
+    for (size_t k : replaced){
+        size_t s = source[k];
+        // replaced don't overlap and go from the end: the first one starting before the source root may hold it.
+        auto other = std::lower_bound(replaced.begin(), replaced.end(), exprs[s].end,
+                                      [&](size_t r, size_t end){ return exprs[r].start > end; });
+        if (other != replaced.end() && exprs[s].end <= exprs[*other].end) return 0;
+        if (names[s].empty()){
+            names[s] = "$gvn" + std::to_string(temps++);
+            edits.push_back({ssa.start + 1, ssa.start + 1, {gvn_node(VARDECL, names[s])}});
+            edits.push_back({exprs[s].end + 1, exprs[s].end + 1,
+                             {gvn_node(VARASSIGN, names[s]), gvn_node(VARREF, names[s])}});
+        }
+        edits.push_back({exprs[k].start, exprs[k].end + 1, {gvn_node(VARREF, names[s])}});
+    }
+    return gvn_apply(ast, edits);
+}
+
+void gvn(std::vector<AST>& ast){
+    size_t temps = 0;
+    long shift = 0;                 // nodes added to the functions before
+    for (func_info_t func : collect_functions(ast)){
+        func.body_start += shift;
+        func.body_end += shift;
+        long hoisted = gvn_hoist(ast, func, temps);
+        func.body_end += hoisted;
+        shift += hoisted + gvn_reuse(ast, func, temps);
+    }
+}
+
+/*
+ * Bytecode of the VM. Each instruction is an opcode followed by its operands.
+ * Locals of a function are numbered from 0 at the bottom of its frame, operands
+ * of expressions are on the stack above them.
+ */
+enum vm_ops_list {
+    VM_CONST,           // value: push value
+    VM_LOAD,            // local: push local
+    VM_STORE,           // local: pop into local
+    VM_STORE_CONST,     // local, value: CONSTANT + VARASSIGN
+    VM_ARG,             // local, n: local = n-th value below the top (argument of inlined body)
+    VM_POP,
+    VM_NEG,
+    VM_NOT,
+    VM_BITNOT,
+    VM_BOOL,            // 1 if top is not 0, else 0
+    VM_ADD,
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_EQ,
+    VM_NE,
+    VM_LT,
+    VM_GT,
+    VM_LE,
+    VM_GE,
+    VM_ADD_CONST,       // local, value: VARREF + CONSTANT + BI_OP, push local op value
+    VM_SUB_CONST,
+    VM_MUL_CONST,
+    VM_EQ_CONST,
+    VM_NE_CONST,
+    VM_LT_CONST,
+    VM_GT_CONST,
+    VM_LE_CONST,
+    VM_GE_CONST,
+    VM_JUMP,            // target
+    VM_JZ,              // target: pop, jump if 0
+    VM_JNZ,             // target: pop, jump if not 0
+    VM_LOOP,            // target, function: jump back to the start of a loop
+    VM_CALL,            // entry (function until linked), arguments, locals, size of frame, function
+    VM_RET,             // pop value, leave function, push value
+    VM_INLINE_RET,      // size, target: pop value, leave size values in frame, push value, jump
+    VM_HALT,            // pop value, stop
+    VM_OPS_NUM,
+};
+
+// Number of operands of each opcode.
+const int vm_operands[VM_OPS_NUM] = {
+    1, 1, 1, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 5, 0, 2, 0,
+};
+
+// Binary operators: opcode on two values, and with constant right operand.
+const std::pair<const char *, std::pair<int, int>> vm_bi_ops[] = {
+    {"+",  {VM_ADD, VM_ADD_CONST}},
+    {"-",  {VM_SUB, VM_SUB_CONST}},
+    {"*",  {VM_MUL, VM_MUL_CONST}},
+    {"/",  {VM_DIV, -1}},
+    {"==", {VM_EQ,  VM_EQ_CONST}},
+    {"!=", {VM_NE,  VM_NE_CONST}},
+    {"<",  {VM_LT,  VM_LT_CONST}},
+    {">",  {VM_GT,  VM_GT_CONST}},
+    {"<=", {VM_LE,  VM_LE_CONST}},
+    {">=", {VM_GE,  VM_GE_CONST}},
+};
+
+struct vm_func_t {
+    std::string name;
+    long entry;             // position in code, -1 if it has no body
+    int params;
+    int locals;
+    int frame;              // locals and largest depth of operands
+    size_t first;           // its nodes, FUNC_DECL to FUNC_PARAMS
+    size_t last;
+    std::set<int> callees;
+    size_t count;           // calls and loop iterations, with tiered execution
+    void *native;           // compiled code, nullptr if not compiled yet
+};
+
+class VM {
+private:
+    std::vector<int> code;
+    std::vector<vm_func_t> funcs;
+    std::vector<long> label_pos;                        // position of each label
+    size_t labels_num = 0;
+    std::vector<std::pair<size_t, size_t>> jumps;       // operand position, label
+    std::vector<size_t> calls;                          // operand positions of VM_CALL
+    std::vector<AST> *nodes;
+
+    // Lowering of a function: its variables and depth of its operands.
+    dvar_t decl_vars;
+    std::stack<size_t> size_dv;
+    int locals;
+    int depth;
+    int max_depth;
+    std::vector<size_t> sizes;                          // operand positions to add locals to
+
+    void op(int opcode, std::initializer_list<int> operands = {}){
+        code.push_back(opcode);
+        code.insert(code.end(), operands.begin(), operands.end());
+    }
+
+    void push(int count){
+        depth += count;
+        max_depth = std::max(max_depth, depth);
+    }
+
+    void jump(int opcode, size_t label){
+        op(opcode, {0});
+        jumps.emplace_back(code.size() - 1, label);
+    }
+
+    size_t new_labels(size_t count){
+        labels_num += count;
+        label_pos.resize(labels_num, -1);
+        return labels_num - count;
+    }
+
+    void place(size_t label){
+        label_pos[label] = code.size();
+    }
+
+    int local(const std::string& name){
+        std::pair<int, int> var = find_var(name, decl_vars);
+        if (var.first == 0){
+            *diag << "Variable is not defined2" << std::endl;
+            throw compile_error_t();
+        }
+        return var.first - 1;           // 0 means not found
+    }
+
+    void declare(const std::string& name, int index){
+        decl_vars.emplace_back(name, index + 1);
+    }
+
+    int func_index(const std::string& name){
+        for (size_t f = 0; f < funcs.size(); f++){
+            if (funcs[f].name == name) return f;
+        }
+        funcs.push_back({name, -1, 0, 0, 0, 0, 0, {}, 0, nullptr});
+        return funcs.size() - 1;
+    }
+
+    // Lowers function declared at ast[current]. Returns index of the node after it.
+    size_t lower_function(std::vector<AST>& ast, size_t current){
+        size_t body = current + 1;
+        while (body < ast.size() && ast[body].check_type() == VARDECL){
+            body++;
+        }
+        vm_func_t& func = funcs[func_index(ast[current].check_func_name())];
+        func.params = body - current - 1;
+        if (body >= ast.size() || ast[body].check_type() != O_BR){     // declaration without body
+            return body;
+        }
+        func.entry = code.size();
+        func.first = current;
+
+        decl_vars.clear();
+        sizes.clear();
+        // Arguments are pushed last first, so the first one is on top: the last local of them.
+        for (int param = 0; param < func.params; param++){
+            declare(ast[current + 1 + param].check_var_name(), func.params - 1 - param);
+        }
+        locals = func.params;
+        depth = 0;
+        max_depth = 0;
+
+        std::stack<size_t> labels;
+        std::stack<size_t> loops;
+        std::stack<int> cond_stack;
+        std::stack<std::pair<int, size_t>> inlines;     // depth before arguments and end label
+        size_t f = &func - funcs.data();
+        current = body;
+        while (ast[current].check_type() != FUNC_PARAMS){
+            AST& node = ast[current];
+            int type = node.check_type();
+            const std::string& op_name = node.check_op();
+            switch (type){
+                case O_BR:
+                    size_dv.push(decl_vars.size());
                     break;
-                }
 
-                if (ast[current].check_op() == "||"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, 0\n");           //check if e1 is true
-                    fprintf(pfile, "\tje label%zu\n", label);    //e1 is 0, so we need to evaluate clause 2
-                    fprintf(pfile, "\tmov eax, 1\n");       // we didn't jump, so e1 is true and therefore result is 1
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    fprintf(pfile, "\tjmp end_label%zu\n", label);
-                    fprintf(pfile, "\tlabel%zu:\n", label);
-                    fprintf(pfile, "\tmov eax, ecx\n");
-                    fprintf(pfile, "\tcmp eax, 0\n");
-                    fprintf(pfile, "\tmov eax, 0\n");           //zero out EAX
-                    fprintf(pfile, "\tsetne al\n");             //set AL if e2 != 0
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    fprintf(pfile, "\tend_label%zu:\n", label);
-                    current++;
-                    label++;
+                case C_BR:
+                    decl_vars.resize(size_dv.top());
+                    size_dv.pop();
                     break;
-                }
 
-                if (ast[current].check_op() == "&&"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcmp eax, 0\n");           //check if e1 is true
-                    fprintf(pfile, "\tjne label%zu\n", label);    //e1 is not 0, so we need to evaluate clause 2
-                    fprintf(pfile, "\tjmp end_label%zu\n", label);
-                    fprintf(pfile, "\tlabel%zu:\n", label);
-                    fprintf(pfile, "\tmov eax, ecx\n");
-                    fprintf(pfile, "\tcmp eax, 0\n");           //check if e2 is true
-                    fprintf(pfile, "\tmov eax, 0\n");           //zero out EAX
-                    fprintf(pfile, "\tsetne al\n");             //set AL if e2 != 0
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    fprintf(pfile, "\tend_label%zu:\n", label);
-                    current++;
-                    label++;
+                case VARDECL:
+                    check_redefinition(node.check_var_name(), decl_vars, size_dv.top());
+                    declare(node.check_var_name(), locals);
+                    op(VM_STORE_CONST, {locals, 0});
+                    locals++;
                     break;
-                }
 
-                if (ast[current].check_op() == "+"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tadd eax, ecx\n");
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
+                case ARG_BIND:
+                    declare(node.check_var_name(), locals);
+                    op(VM_ARG, {locals, node.check_inum()});
+                    locals++;
                     break;
-                }
 
-                if (ast[current].check_op() == "*"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\timul eax, ecx\n");
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
+                case VARASSIGN:
+                    op(VM_STORE, {local(node.check_var_name())});
+                    push(-1);
                     break;
-                }
 
-                if (ast[current].check_op() == "-"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tsub eax, ecx\n");
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
+                case CONSTANT:
+                    if (ast[current + 1].check_type() == VARASSIGN){
+                        op(VM_STORE_CONST, {local(ast[current + 1].check_var_name()), node.check_inum()});
+                        current++;
+                        break;
+                    }
+                    op(VM_CONST, {node.check_inum()});
+                    push(1);
                     break;
-                }
 
-                if (ast[current].check_op() == "/"){
-                    fprintf(pfile, "\tpop ecx\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tpop eax\n");
-                    stack_index += 4;
-                    fprintf(pfile, "\tcdq\n");      // sign extend EAX to EDX.
-                    fprintf(pfile, "\tidiv ecx\n"); // quotient in EAX, remainder in EDX
-                    fprintf(pfile, "\tpush eax\n");
-                    stack_index -= 4;
-                    current++;
+                case VARREF:
+                    if (ast[current + 1].check_type() == EXPR_END){        // value of assignment statement
+                        local(node.check_var_name());
+                        current++;
+                        break;
+                    }
+                    if (ast[current + 1].check_type() == CONSTANT && ast[current + 2].check_type() == BI_OP){
+                        int fused = -1;
+                        for (const auto& bi_op : vm_bi_ops){
+                            if (ast[current + 2].check_op() == bi_op.first) fused = bi_op.second.second;
+                        }
+                        if (fused >= 0){
+                            op(fused, {local(node.check_var_name()), ast[current + 1].check_inum()});
+                            push(1);
+                            current += 2;
+                            break;
+                        }
+                    }
+                    op(VM_LOAD, {local(node.check_var_name())});
+                    push(1);
                     break;
-                }
 
-            default:
-                std::cout << "Code generation ERROR";
-                exit(0);
+                case UN_OP:
+                    op(op_name == "-" ? VM_NEG : op_name == "!" ? VM_NOT : VM_BITNOT);
+                    break;
+
+                case BI_OP:
+                    if (op_name == "&&" || op_name == "||"){   // right operand, SHORT_CIRC jumps to label with the left one
+                        op(VM_BOOL);
+                        jump(VM_JUMP, labels.top() + 1);
+                        place(labels.top());
+                        op(VM_CONST, {op_name == "||" ? 1 : 0});
+                        place(labels.top() + 1);
+                        labels.pop();
+                        break;
+                    }
+                    for (const auto& bi_op : vm_bi_ops){
+                        if (op_name == bi_op.first) op(bi_op.second.first);
+                    }
+                    push(-1);
+                    break;
+
+                case EXPR_END:
+                    op(VM_POP);
+                    push(-1);
+                    break;
+
+                case CALL_BEGIN:
+                    break;
+
+                case FUNC_CALL:
+                    op(VM_CALL, {func_index(node.check_func_name()), node.check_inum(), 0, 0, 0});
+                    calls.push_back(code.size() - 5);
+                    funcs[f].callees.insert(code[code.size() - 5]);
+                    push(1 - node.check_inum());
+                    break;
+
+                case RET:
+                    op(VM_RET);
+                    push(-1);
+                    break;
+
+                case INLINE_BEGIN:
+                    inlines.emplace(depth - node.check_inum(), new_labels(1));
+                    break;
+
+                case INLINE_RET:
+                    op(VM_INLINE_RET, {inlines.top().first, 0});
+                    sizes.push_back(code.size() - 2);
+                    jumps.emplace_back(code.size() - 1, inlines.top().second);
+                    push(-1);
+                    break;
+
+                case INLINE_END:
+                    place(inlines.top().second);
+                    depth = inlines.top().first;
+                    push(1);
+                    inlines.pop();
+                    break;
+
+                case WHILE_LABEL:
+                    loops.push(new_labels(3));
+                    place(loops.top());
+                    break;
+
+                case WHILE_NEXT:
+                    place(loops.top() + 1);
+                    break;
+
+                case WHILE_EXPR:
+                    jump(VM_JZ, loops.top() + 2);
+                    push(-1);
+                    break;
+
+                case WHILE_END:
+                    op(VM_LOOP, {0, (int)f});
+                    jumps.emplace_back(code.size() - 2, loops.top());
+                    place(loops.top() + 2);
+                    loops.pop();
+                    break;
+
+                case NEXT:
+                case SKIP:
+                    if (loops.empty()){
+                        *diag << (type == NEXT ? "Continue" : "Break") << " is not in a loop" << std::endl;
+                        throw compile_error_t();
+                    }
+                    jump(VM_JUMP, loops.top() + (type == NEXT ? 1 : 2));
+                    break;
+
+                case SHORT_CIRC:
+                    labels.push(new_labels(2));
+                    jump(op_name == "&&" ? VM_JZ : VM_JNZ, labels.top());
+                    push(-1);
+                    break;
+
+                case COND_QUEST:
+                case IF_ELSE:
+                    labels.push(new_labels(1));
+                    jump(VM_JZ, labels.top());
+                    push(-1);
+                    cond_stack.push(depth);
+                    break;
+
+                case COND_COLON:
+                case IF_BODY:
+                    depth = cond_stack.top();       // only one of the arms pushes its value
+                    jump(VM_JUMP, new_labels(1));
+                    place(labels.top());
+                    labels.pop();
+                    labels.push(labels_num - 1);
+                    break;
+
+                case COND_END:
+                case IF_END:
+                    place(labels.top());
+                    labels.pop();
+                    depth = cond_stack.top() + (type == COND_END ? 1 : 0);
+                    cond_stack.pop();
+                    break;
+
+                default:
+                    *diag << "Code generation ERROR";
+                    throw compile_error_t();
+            }
+            current++;
+        }
+        op(VM_CONST, {0});                  // no return at the end
+        op(VM_RET);
+        push(1);
+        for (size_t pos : sizes){
+            code[pos] += locals;
+        }
+        funcs[f].locals = locals;
+        funcs[f].frame = locals + max_depth;
+        funcs[f].last = current;
+        return current + 1;
+    }
+
+    /*
+     * Compiles function f and the functions it calls, which native code calls directly.
+     * Calls of them in threaded code are patched to call their native code instead,
+     * if it takes all arguments in registers.
+     */
+    void promote(int f, std::vector<intptr_t>& threaded, void *native_handler){
+        std::set<int> group = {f};
+        std::vector<int> work = {f};
+        while (!work.empty()){
+            int g = work.back();
+            work.pop_back();
+            for (int callee : funcs[g].callees){
+                if (group.insert(callee).second) work.push_back(callee);
+            }
+        }
+        std::vector<AST> module;
+        for (int g : group){
+            module.insert(module.end(), nodes->begin() + funcs[g].first, nodes->begin() + funcs[g].last + 1);
+        }
+        Assembler as(nullptr, false);
+        to_asm(module, as);
+        std::map<std::string, void *> addresses = jit_load(as);
+        for (int g : group){
+            if (funcs[g].native == nullptr){
+                funcs[g].native = addresses[funcs[g].name];
+                *diag << "Tier up: " << funcs[g].name << std::endl;
+            }
+        }
+        for (size_t pos : calls){
+            const vm_func_t& callee = funcs[code[pos + 4]];
+            if (callee.native != nullptr && callee.params <= reg_args_num){
+                threaded[pos - 1] = (intptr_t)native_handler;
+                threaded[pos] = (intptr_t)callee.native;
+            }
+        }
+    }
+
+public:
+    // Lowers the program; code starts with a call of main.
+    void lower(std::vector<AST>& ast){
+        nodes = &ast;
+        op(VM_CALL, {func_index("main"), 0, 0, 0, 0});
+        calls.push_back(1);
+        op(VM_HALT);
+        size_t current = 0;
+        while (current < ast.size()){
+            if (ast[current].check_type() != FUNC_DECL){
+                *diag << "Code generation ERROR";
+                throw compile_error_t();
+            }
+            current = lower_function(ast, current);
+        }
+        for (const auto& jump : jumps){
+            code[jump.first] = label_pos[jump.second];
+        }
+        for (size_t pos : calls){
+            const vm_func_t& func = funcs[code[pos]];
+            if (func.entry < 0){
+                *diag << "Function is not defined: " << func.name << std::endl;
+                throw compile_error_t();
+            }
+            if (func.params != code[pos + 1]){
+                *diag << "Wrong number of arguments: " << func.name << std::endl;
+                throw compile_error_t();
+            }
+            code[pos + 4] = code[pos];
+            code[pos] = func.entry;
+            code[pos + 2] = func.locals;
+            code[pos + 3] = func.frame;
+        }
+    }
+
+    /*
+     * Runs the code from the start and returns value of main.
+     * Dispatch is direct threaded: opcodes are replaced with addresses of their handlers,
+     * each handler jumps straight to the handler of the next instruction.
+     */
+    int run(){
+        static void *handlers[VM_OPS_NUM] = {
+            &&op_const, &&op_load, &&op_store, &&op_store_const, &&op_arg, &&op_pop, &&op_neg, &&op_not,
+            &&op_bitnot, &&op_bool, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_eq, &&op_ne, &&op_lt,
+            &&op_gt, &&op_le, &&op_ge, &&op_add_const, &&op_sub_const, &&op_mul_const, &&op_eq_const,
+            &&op_ne_const, &&op_lt_const, &&op_gt_const, &&op_le_const, &&op_ge_const, &&op_jump, &&op_jz,
+            &&op_jnz, &&op_loop, &&op_call, &&op_ret, &&op_inline_ret, &&op_halt,
+        };
+        std::vector<intptr_t> threaded(code.begin(), code.end());
+        for (size_t pos = 0; pos < code.size(); pos += 1 + vm_operands[code[pos]]){
+            threaded[pos] = (intptr_t)handlers[code[pos]];
+            if (tiered && code[pos] == VM_CALL) threaded[pos] = (intptr_t)&&op_call_counted;
+            if (tiered && code[pos] == VM_LOOP) threaded[pos] = (intptr_t)&&op_loop_counted;
         }
+        std::vector<int> stack(1 << 22);
+        std::vector<std::pair<intptr_t *, int *>> frames;      // return address and frame of callers
+        intptr_t *start = threaded.data();
+        intptr_t *pc = start;
+        int *fp = stack.data();
+        int *sp = fp;
+        int *stack_end = stack.data() + stack.size();
+        int value;
+
+        #define DISPATCH() goto *(void *)*pc
+        #define BINARY(expr) { unsigned b = *--sp; unsigned a = sp[-1]; sp[-1] = (int)(expr); pc += 1; DISPATCH(); }
+        #define BINARY_CONST(expr) { unsigned a = fp[pc[1]]; unsigned b = pc[2]; *sp++ = (int)(expr); pc += 3; DISPATCH(); }
+        DISPATCH();
+
+        op_const:       *sp++ = pc[1]; pc += 2; DISPATCH();
+        op_load:        *sp++ = fp[pc[1]]; pc += 2; DISPATCH();
+        op_store:       fp[pc[1]] = *--sp; pc += 2; DISPATCH();
+        op_store_const: fp[pc[1]] = pc[2]; pc += 3; DISPATCH();
+        op_arg:         fp[pc[1]] = sp[-1 - pc[2]]; pc += 3; DISPATCH();
+        op_pop:         sp--; pc += 1; DISPATCH();
+        op_neg:         sp[-1] = (int)(0u - (unsigned)sp[-1]); pc += 1; DISPATCH();
+        op_not:         sp[-1] = sp[-1] == 0; pc += 1; DISPATCH();
+        op_bitnot:      sp[-1] = ~sp[-1]; pc += 1; DISPATCH();
+        op_bool:        sp[-1] = sp[-1] != 0; pc += 1; DISPATCH();
+        op_add:         BINARY(a + b)
+        op_sub:         BINARY(a - b)
+        op_mul:         BINARY(a * b)
+        op_div:
+            if (sp[-1] == 0 || (sp[-1] == -1 && sp[-2] == INT_MIN)){
+                *diag << "VM: division overflow" << std::endl;
+                throw compile_error_t();
+            }
+            sp[-2] = sp[-2] / sp[-1];
+            sp--;
+            pc += 1;
+            DISPATCH();
+        op_eq:          BINARY((int)a == (int)b)
+        op_ne:          BINARY((int)a != (int)b)
+        op_lt:          BINARY((int)a < (int)b)
+        op_gt:          BINARY((int)a > (int)b)
+        op_le:          BINARY((int)a <= (int)b)
+        op_ge:          BINARY((int)a >= (int)b)
+        op_add_const:   BINARY_CONST(a + b)
+        op_sub_const:   BINARY_CONST(a - b)
+        op_mul_const:   BINARY_CONST(a * b)
+        op_eq_const:    BINARY_CONST((int)a == (int)b)
+        op_ne_const:    BINARY_CONST((int)a != (int)b)
+        op_lt_const:    BINARY_CONST((int)a < (int)b)
+        op_gt_const:    BINARY_CONST((int)a > (int)b)
+        op_le_const:    BINARY_CONST((int)a <= (int)b)
+        op_ge_const:    BINARY_CONST((int)a >= (int)b)
+        op_jump:        pc = start + pc[1]; DISPATCH();
+        op_jz:          pc = *--sp == 0 ? start + pc[1] : pc + 2; DISPATCH();
+        op_jnz:         pc = *--sp != 0 ? start + pc[1] : pc + 2; DISPATCH();
+        op_loop:        pc = start + pc[1]; DISPATCH();
+        op_loop_counted:
+            if (++funcs[pc[2]].count == tier_threshold){
+                promote(pc[2], threaded, &&op_call_native);
+            }
+            pc = start + pc[1];
+            DISPATCH();
+        op_call_counted:
+            if (++funcs[pc[5]].count == tier_threshold){
+                promote(pc[5], threaded, &&op_call_native);
+                DISPATCH();                 // again, native if it was patched
+            }
+            goto op_call;
+        op_call_native: {
+            int args[6] = {0, 0, 0, 0, 0, 0};
+            for (int k = 0; k < pc[2]; k++){
+                args[k] = sp[-1 - k];
+            }
+            sp -= pc[2];
+            *sp++ = ((int (*)(int, int, int, int, int, int))pc[1])(args[0], args[1], args[2], args[3], args[4], args[5]);
+            pc += 6;
+            DISPATCH();
+        }
+        op_call:
+            if (sp - pc[2] + pc[4] > stack_end){
+                *diag << "VM: stack overflow" << std::endl;
+                throw compile_error_t();
+            }
+            frames.emplace_back(pc + 6, fp);
+            fp = sp - pc[2];                // arguments become the first locals
+            sp = fp + pc[3];
+            pc = start + pc[1];
+            DISPATCH();
+        op_ret:
+            value = *--sp;
+            sp = fp;
+            pc = frames.back().first;
+            fp = frames.back().second;
+            frames.pop_back();
+            *sp++ = value;
+            DISPATCH();
+        op_inline_ret:
+            value = *--sp;
+            sp = fp + pc[1];
+            *sp++ = value;
+            pc = start + pc[2];
+            DISPATCH();
+        op_halt:
+            return *--sp;
+
+        #undef DISPATCH
+        #undef BINARY
+        #undef BINARY_CONST
     }
-    fclose(pfile);
+};
+
+int vm_run(std::vector<AST>& ast){
+    VM vm;
+    vm.lower(ast);
+    int value = vm.run();
+    *diag << "VM: main returned " << value << std::endl;
+    return value;
 }
 
 std::vector<AST> parser(const tokens_t& tokens){
@@ -1290,8 +6161,8 @@ tokens_t lexer(const std::string& input){
 
         // Cyrillic
         if (int(symbol) < 0 || int(symbol) > 127){                      // Error if not ASCII symbol.
-            std::cout << "Undefined symbol " << symbol << "at position" << current << std::endl;
-            exit(0);
+            *diag << "Undefined symbol " << symbol << "at position" << current << std::endl;
+            throw compile_error_t();
         }
 
         // Comments /*...*/
@@ -1401,8 +6272,8 @@ tokens_t lexer(const std::string& input){
             if (value == "&&"){
                 tokens.emplace_back(AND, value);
             } else {
-                std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                exit(0);
+                *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                throw compile_error_t();
             }
             continue;
         }
@@ -1419,8 +6290,8 @@ tokens_t lexer(const std::string& input){
             if (value == "||"){
                 tokens.emplace_back(OR, value);
             } else {
-                std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                exit(0);
+                *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                throw compile_error_t();
             }
             continue;
         }
@@ -1440,8 +6311,8 @@ tokens_t lexer(const std::string& input){
                 if (value == "=="){
                     tokens.emplace_back(EQU, value);
                 } else {
-                    std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                    exit(0);
+                    *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                    throw compile_error_t();
                 }
             }
             continue;
@@ -1462,8 +6333,8 @@ tokens_t lexer(const std::string& input){
                 if (value == "!"){
                     tokens.emplace_back(LNEG, value);
                 } else {
-                    std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                    exit(0);
+                    *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                    throw compile_error_t();
                 }
             }
             continue;
@@ -1484,8 +6355,8 @@ tokens_t lexer(const std::string& input){
                 if (value == "<"){
                     tokens.emplace_back(LESS, value);
                 } else {
-                    std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                    exit(0);
+                    *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                    throw compile_error_t();
                 }
             }
             continue;
@@ -1506,8 +6377,8 @@ tokens_t lexer(const std::string& input){
                 if (value == ">"){
                     tokens.emplace_back(GREAT, value);
                 } else {
-                    std::cout << "Undefined symbol " << value << " at position " << current << std::endl;
-                    exit(0);
+                    *diag << "Undefined symbol " << value << " at position " << current << std::endl;
+                    throw compile_error_t();
                 }
             }
             continue;
@@ -1622,8 +6493,8 @@ tokens_t lexer(const std::string& input){
                     value += symbol;
                     symbol = input[++current];
                 }
-                std::cout << "Wrong identifier " << value << std::endl;
-                exit(0);
+                *diag << "Wrong identifier " << value << std::endl;
+                throw compile_error_t();
             } else {
                 tokens.emplace_back(I_NUM, value);
                 continue;
@@ -1632,8 +6503,8 @@ tokens_t lexer(const std::string& input){
 
         // Illegal symbols
         if (symbol == '`' || symbol == '@' || symbol == '#' || symbol == '$' || symbol == '\\'){
-            std::cout << "Illegal symbol " << symbol << " at position " << current << std::endl;
-            exit(0);
+            *diag << "Illegal symbol " << symbol << " at position " << current << std::endl;
+            throw compile_error_t();
         }
 
         current++;
@@ -1642,23 +6513,30 @@ tokens_t lexer(const std::string& input){
     return tokens;
 }
 
+unsigned long option_number(const std::string& option, const std::string& text){
+    errno = 0;
+    unsigned long value = strtoul(text.c_str(), nullptr, 10);
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos || errno == ERANGE){
+        std::cout << "Invalid number in option: " << option << std::endl;
+        exit(1);
+    }
+    return value;
+}
+
 std::string read_file(const std::string& file_location){
-    std::string input;
-    std::string current_line;
-    std::ifstream file (file_location);     // open file to read from.
-    if (file.is_open()){
-        while (!file.eof()){
-            getline(file, current_line);
-            input += current_line;
-        }
+    std::ifstream file (file_location, std::ios::binary);     // open file to read from.
+    if (!file.is_open()){
+        *diag << "Can't open input file: " << file_location << std::endl;
+        throw compile_error_t();
     }
-    file.close();
-    return input;
+    std::ostringstream input;
+    input << file.rdbuf();      // whole file, with line breaks between tokens.
+    return input.str();
 }
 
 void out_tokens(const tokens_t& tokens){
     for (size_t i = 0; i < tokens.size(); i++){
-        std::cout << tokens[i].first << " -> " << tokens[i].second << std::endl;
+        *diag << tokens[i].first << " -> " << tokens[i].second << std::endl;
     }
 }
 
@@ -1674,6 +6552,7 @@ bool find_str_vec(const std::string& key, const std::vector<std::string>& vector
 }
 
 std::pair<int, int> find_var(const std::string& key, const dvar_t& decl_vars){
+    report.lookups++;
         size_t i = decl_vars.size()-1;
         while (i >= 0 && i < decl_vars.size()){
             if (key == decl_vars[i].first){
@@ -1684,3 +6563,301 @@ std::pair<int, int> find_var(const std::string& key, const dvar_t& decl_vars){
         }
     return {0, 0};
 }
+
+void check_redefinition(const std::string& key, const dvar_t& decl_vars, size_t scope){
+    report.lookups++;
+    for (size_t i = decl_vars.size(); i-- > scope;){
+        if (key == decl_vars[i].first){
+            *diag << "Variable is already defined" << std::endl;
+            throw compile_error_t();
+        }
+    }
+}
+
+void epilogue(Assembler& as, size_t saved, long int stack_index, bool frame_pointer){
+    if (!frame_pointer){
+        long int size = -word * (long int)saved - word - stack_index;   // everything below saved registers
+        if (size > 0){
+            as.ins(I_ADD, wide_opd(ESP), imm_opd(size));
+        }
+    } else if (saved == 0){
+        as.ins(I_MOV, wide_opd(ESP), wide_opd(EBP));   //restore stack pointer; now it points to old frame pointer
+    } else {
+        as.ins(I_LEA, wide_opd(ESP), mem_opd(EBP, -word * (long int)saved));
+    }
+    for (size_t reg = saved; reg-- > 0;){
+        as.ins(I_POP, wide_opd(var_regs[reg]));
+    }
+    if (frame_pointer){
+        as.ins(I_POP, wide_opd(EBP));  // restore old frame pointer; now stack is as it was before prologue
+    }
+}
+
+long int func_slot(size_t saved, int slot){
+    return -word * (long int)(saved + 1 + slot);
+}
+
+void set_target(const std::string& name){
+    if (name == "i386"){
+        x86_64 = false;
+        word = 4;
+        var_regs = var_regs_i386;
+        var_regs_num = 3;
+        arg_regs = arg_regs_i386;
+        reg_args_num = 2;
+        external_reg_args = 0;
+    } else if (name == "x86-64"){
+        x86_64 = true;
+        word = 8;
+        var_regs = var_regs_x86_64;
+        var_regs_num = 5;
+        arg_regs = arg_regs_x86_64;
+        reg_args_num = 6;
+        external_reg_args = 6;
+    } else {
+        std::cout << "Unknown target: " << name << std::endl;
+        exit(1);
+    }
+}
+
+int negate_cc(int cc){
+    return cc ^ 1;
+}
+
+int swap_cc(int cc){
+    const int pairs[][2] = {{CC_L, CC_G}, {CC_LE, CC_GE}};
+    for (const auto& pair : pairs){
+        if (cc == pair[0]) return pair[1];
+        if (cc == pair[1]) return pair[0];
+    }
+    return cc;
+}
+
+operand_t reg_opd(int reg){
+    operand_t opd;
+    opd.kind = OPD_REG;
+    opd.reg = reg;
+    return opd;
+}
+
+operand_t wide_opd(int reg){
+    operand_t opd = reg_opd(reg);
+    opd.wide = x86_64;
+    return opd;
+}
+
+operand_t imm_opd(long int value){
+    operand_t opd;
+    opd.kind = OPD_IMM;
+    opd.value = value;
+    return opd;
+}
+
+operand_t mem_opd(int base, long int disp, int index, int scale){
+    operand_t opd;
+    opd.kind = OPD_MEM;
+    opd.reg = base;
+    opd.index = index;
+    opd.scale = scale;
+    opd.value = disp;
+    return opd;
+}
+
+operand_t label_opd(const std::string& name){
+    operand_t opd;
+    opd.kind = OPD_LABEL;
+    opd.name = name;
+    return opd;
+}
+
+operand_t symbol_opd(const std::string& name){
+    operand_t opd;
+    opd.kind = OPD_SYMBOL;
+    opd.name = name;
+    return opd;
+}
+
+size_t const_operand(std::vector<AST>& ast, size_t current, int& value){
+    value = ast[current].check_inum();
+    current++;
+    if (current < ast.size() && ast[current].check_type() == UN_OP && ast[current].check_op() == "-"){
+        value = (int)(0u - (unsigned)value);
+        current++;
+    }
+    return current;
+}
+
+void mul_by_const(Assembler& as, int value){
+    unsigned u = value;
+    bool negative = value < 0 && value != INT_MIN;     // x * INT_MIN == x << 31
+    if (negative) u = 0u - u;
+
+    int shift = 0;
+    while (shift < 31 && !((u >> shift) & 1)) shift++;
+    unsigned odd = u >> shift;          // u == odd * 2^shift
+
+    if (u == 0){
+        as.ins(I_MOV, reg_opd(EAX), imm_opd(0));
+        return;
+    }
+    if (odd == 1 || odd == 3 || odd == 5 || odd == 9){
+        if (odd != 1){
+            as.ins(I_LEA, reg_opd(EAX), mem_opd(EAX, 0, EAX, odd - 1));
+        }
+        if (shift > 0){
+            as.ins(I_SHL, reg_opd(EAX), imm_opd(shift));
+        }
+    } else if (u < 0x80000000u && ((u - 1) & (u - 2)) == 0){       // 2^k + 1
+        as.ins(I_MOV, reg_opd(ECX), reg_opd(EAX));
+        as.ins(I_SHL, reg_opd(EAX), imm_opd(__builtin_ctz(u - 1)));
+        as.ins(I_ADD, reg_opd(EAX), reg_opd(ECX));
+    } else if (u < 0x80000000u && ((u + 1) & u) == 0){             // 2^k - 1
+        as.ins(I_MOV, reg_opd(ECX), reg_opd(EAX));
+        as.ins(I_SHL, reg_opd(EAX), imm_opd(__builtin_ctz(u + 1)));
+        as.ins(I_SUB, reg_opd(EAX), reg_opd(ECX));
+    } else {
+        as.ins(I_IMUL, reg_opd(EAX), reg_opd(EAX), imm_opd(value));
+        return;
+    }
+    if (negative){
+        as.ins(I_NEG, reg_opd(EAX));
+    }
+}
+
+/*
+ * Truncating division, same as idiv:
+ *  2^k:    add 2^k - 1 to negative dividend, then arithmetic shift.
+ *  other:  high half of dividend * magic, corrected and shifted, plus 1 if negative.
+ * Division by 0 is left to idiv so it traps as before.
+ */
+void div_by_const(Assembler& as, int value){
+    if (value == 0){
+        as.ins(I_MOV, reg_opd(ECX), imm_opd(0));
+        as.ins(I_CDQ);
+        as.ins(I_IDIV, reg_opd(ECX));
+        return;
+    }
+    if (value == 1){
+        return;
+    }
+    if (value == -1){
+        as.ins(I_NEG, reg_opd(EAX));
+        return;
+    }
+    if (value == INT_MIN){
+        as.ins(I_CMP, reg_opd(EAX), imm_opd(INT_MIN));
+        as.ins(I_MOV, reg_opd(EAX), imm_opd(0));
+        as.setcc(CC_E);
+        return;
+    }
+
+    unsigned abs_value = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    if ((abs_value & (abs_value - 1)) == 0){
+        int shift = __builtin_ctz(abs_value);
+        as.ins(I_CDQ);                                  // EDX = -1 if dividend is negative
+        if (shift == 1){
+            as.ins(I_SUB, reg_opd(EAX), reg_opd(EDX));
+        } else {
+            as.ins(I_AND, reg_opd(EDX), imm_opd(abs_value - 1));
+            as.ins(I_ADD, reg_opd(EAX), reg_opd(EDX));
+        }
+        as.ins(I_SAR, reg_opd(EAX), imm_opd(shift));
+        if (value < 0){
+            as.ins(I_NEG, reg_opd(EAX));
+        }
+        return;
+    }
+
+    std::pair<int, int> magic = div_magic(value);
+    as.ins(I_MOV, reg_opd(ECX), reg_opd(EAX));
+    as.ins(I_MOV, reg_opd(EAX), imm_opd(magic.first));
+    as.ins(I_IMUL, reg_opd(ECX));                                 // EDX = high half of magic * dividend
+    if (value > 0 && magic.first < 0){
+        as.ins(I_ADD, reg_opd(EDX), reg_opd(ECX));
+    }
+    if (value < 0 && magic.first > 0){
+        as.ins(I_SUB, reg_opd(EDX), reg_opd(ECX));
+    }
+    if (magic.second > 0){
+        as.ins(I_SAR, reg_opd(EDX), imm_opd(magic.second));
+    }
+    as.ins(I_MOV, reg_opd(EAX), reg_opd(EDX));
+    as.ins(I_SHR, reg_opd(EAX), imm_opd(31));                              // round towards zero
+    as.ins(I_ADD, reg_opd(EAX), reg_opd(EDX));
+}
+
+std::pair<int, int> div_magic(int divisor){
+    const unsigned two31 = 0x80000000u;
+    unsigned ad = divisor < 0 ? 0u - (unsigned)divisor : (unsigned)divisor;
+    unsigned t = two31 + ((unsigned)divisor >> 31);
+    unsigned anc = t - 1 - t % ad;      // absolute value of nc
+    int p = 31;
+    unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+    unsigned q2 = two31 / ad, r2 = two31 - q2 * ad;
+    unsigned delta;
+    do {
+        p++;
+        q1 = 2 * q1;
+        r1 = 2 * r1;
+        if (r1 >= anc){
+            q1++;
+            r1 -= anc;
+        }
+        q2 = 2 * q2;
+        r2 = 2 * r2;
+        if (r2 >= ad){
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    unsigned magic = q2 + 1;
+    if (divisor < 0) magic = 0u - magic;
+    return {(int)magic, p - 32};
+}
+
+std::map<std::string, void *> jit_load(Assembler& as){
+#if defined(__linux__) && defined(__x86_64__)
+    as.link();
+    const std::vector<unsigned char>& code = as.machine_code();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = std::max((code.size() + page - 1) / page * page, page);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED){
+        *diag << "JIT: no memory" << std::endl;
+        throw compile_error_t();
+    }
+    memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0){
+        *diag << "JIT: memory can't be made executable" << std::endl;
+        throw compile_error_t();
+    }
+
+    std::map<std::string, void *> addresses;
+    const std::vector<std::pair<std::string, size_t>>& functions = as.symbols();
+    FILE *map = fopen(("/tmp/perf-" + std::to_string(getpid()) + ".map").c_str(), "a");
+    for (size_t k = 0; k < functions.size(); k++){
+        unsigned char *start = (unsigned char *)memory + functions[k].second;
+        size_t end = k + 1 < functions.size() ? functions[k + 1].second : code.size();
+        if (map) fprintf(map, "%lx %zx %s\n", (unsigned long)start, end - functions[k].second, functions[k].first.c_str());
+        addresses[functions[k].first] = start;
+    }
+    if (map) fclose(map);
+    return addresses;
+#else
+    *diag << "JIT is supported on x86-64 Linux only" << std::endl;
+    throw compile_error_t();
+#endif
+}
+
+int jit_run(Assembler& as){
+    std::map<std::string, void *> addresses = jit_load(as);
+    if (addresses.find("main") == addresses.end()){
+        *diag << "JIT: main is not defined" << std::endl;
+        throw compile_error_t();
+    }
+    int value = ((int (*)())addresses["main"])();
+    *diag << "JIT: main returned " << value << std::endl;
+    return value;
+}
@@ -0,0 +1,3 @@
+int main() {
+    return 1000 / 7 + (-100) / 8 + (-99) / -9;
+}
\ No newline at end of file
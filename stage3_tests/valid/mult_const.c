@@ -0,0 +1,3 @@
+int main() {
+    return 3 * 10 + 2 * -5 + 7 * 9;
+}
\ No newline at end of file
@@ -0,0 +1,17 @@
+int main() {
+    int a = 1;
+    int b = 2;
+    int c = 3;
+    int sum = 0;
+    {
+        int x = a + b;
+        int y = x * c;
+        sum = sum + x + y;
+    }
+    {
+        int z = sum - a;
+        int w = z + b + c;
+        sum = sum + z + w;
+    }
+    return sum + a + b + c;
+}
@@ -0,0 +1,30 @@
+int main() {
+    int s = 0;
+    int found = 0;
+    for (int i = 0; i < 5; i = i + 1) {
+        int j = 0;
+        while (1) {
+            if (j * j > i * 3)
+                break;
+            s = s + j;
+            j = j + 1;
+        }
+        s = s + j * 10;
+        do {
+            found = found + 1;
+            if (found > i)
+                break;
+            s = s + 1;
+        } while (1);
+        for (int k = 0; k < 10; k = k + 1) {
+            for (int l = 0; l < 10; l = l + 1) {
+                if (l == k)
+                    break;
+                s = s + l;
+            }
+            if (k == i)
+                break;
+        }
+    }
+    return s;
+}
@@ -0,0 +1,30 @@
+int main() {
+    int s = 0;
+    for (int i = 0; i < 8; i = i + 1) {
+        if (i == 3)
+            continue;
+        s = s + i;
+    }
+    int c = 0;
+    for (int i = 1; i < 100; i = i * 2 + 1) {
+        c = c + 1;
+        if ((i / 3) * 3 == i)
+            continue;
+        s = s + i;
+    }
+    for (int i = 0; i < 4; i = i + 1) {
+        for (int j = 0; j < 5; j = j + 1) {
+            if (j == i)
+                continue;
+            s = s + j;
+        }
+        if (i == 2)
+            continue;
+        s = s + 10;
+    }
+    int k;
+    for (k = 0; k < 10; k = k + 1)
+        if (k < 7)
+            continue;
+    return s + c + k;
+}
@@ -0,0 +1,107 @@
+int main() {
+    int bad = 0;
+    int x = -30000;
+
+    while (x < 30000) {
+        int seven = 7;
+        int ten = 10;
+        int minus_three = -3;
+        int sixteen = 16;
+        if (x / 7 != x / seven) bad = bad + 1;
+        if (x / 10 != x / ten) bad = bad + 1;
+        if (x / -3 != x / minus_three) bad = bad + 1;
+        if (x / 16 != x / sixteen) bad = bad + 1;
+        if (x * 10 != x * ten) bad = bad + 1;
+        if (x * -3 != x * minus_three) bad = bad + 1;
+        x = x + 13;
+    }
+
+    int i = 0;
+    while (i < 900) {
+        x = 0;
+        if (i < 300) x = -2147483647 - 1 + i * 3;
+        else if (i < 600) x = 2147483647 - (i - 300) * 3;
+        else x = (i - 750) * 14316557;
+
+        int d2 = 2;
+        int d3 = 3;
+        int d5 = 5;
+        int d9 = 9;
+        int d15 = 15;
+        int d17 = 17;
+        int d31 = 31;
+        int d33 = 33;
+        int d63 = 63;
+        int d65 = 65;
+        int d127 = 127;
+        int d255 = 255;
+        int d257 = 257;
+        int d641 = 641;
+        int d1000 = 1000;
+        int d1023 = 1023;
+        int d1025 = 1025;
+        int d12345 = 12345;
+        int d65535 = 65535;
+        int d65537 = 65537;
+        int d1000000007 = 1000000007;
+        int d1073741824 = 1073741824;
+        int d1073741825 = 1073741825;
+        int d2147483647 = 2147483647;
+        int m2 = -2;
+        int m3 = -3;
+        int m5 = -5;
+        int m7 = -7;
+        int m16 = -16;
+        int m17 = -17;
+        int m641 = -641;
+        int m1000 = -1000;
+        int m1023 = -1023;
+        int m12345 = -12345;
+        int m65537 = -65537;
+        int m1000000007 = -1000000007;
+        int m1073741824 = -1073741824;
+        int m2147483647 = -2147483647;
+
+        if (x / 2 != x / d2) bad = bad + 1;
+        if (x / 3 != x / d3) bad = bad + 1;
+        if (x / 5 != x / d5) bad = bad + 1;
+        if (x / 9 != x / d9) bad = bad + 1;
+        if (x / 15 != x / d15) bad = bad + 1;
+        if (x / 17 != x / d17) bad = bad + 1;
+        if (x / 31 != x / d31) bad = bad + 1;
+        if (x / 33 != x / d33) bad = bad + 1;
+        if (x / 63 != x / d63) bad = bad + 1;
+        if (x / 65 != x / d65) bad = bad + 1;
+        if (x / 127 != x / d127) bad = bad + 1;
+        if (x / 255 != x / d255) bad = bad + 1;
+        if (x / 257 != x / d257) bad = bad + 1;
+        if (x / 641 != x / d641) bad = bad + 1;
+        if (x / 1000 != x / d1000) bad = bad + 1;
+        if (x / 1023 != x / d1023) bad = bad + 1;
+        if (x / 1025 != x / d1025) bad = bad + 1;
+        if (x / 12345 != x / d12345) bad = bad + 1;
+        if (x / 65535 != x / d65535) bad = bad + 1;
+        if (x / 65537 != x / d65537) bad = bad + 1;
+        if (x / 1000000007 != x / d1000000007) bad = bad + 1;
+        if (x / 1073741824 != x / d1073741824) bad = bad + 1;
+        if (x / 1073741825 != x / d1073741825) bad = bad + 1;
+        if (x / 2147483647 != x / d2147483647) bad = bad + 1;
+        if (x / -2 != x / m2) bad = bad + 1;
+        if (x / -3 != x / m3) bad = bad + 1;
+        if (x / -5 != x / m5) bad = bad + 1;
+        if (x / -7 != x / m7) bad = bad + 1;
+        if (x / -16 != x / m16) bad = bad + 1;
+        if (x / -17 != x / m17) bad = bad + 1;
+        if (x / -641 != x / m641) bad = bad + 1;
+        if (x / -1000 != x / m1000) bad = bad + 1;
+        if (x / -1023 != x / m1023) bad = bad + 1;
+        if (x / -12345 != x / m12345) bad = bad + 1;
+        if (x / -65537 != x / m65537) bad = bad + 1;
+        if (x / -1000000007 != x / m1000000007) bad = bad + 1;
+        if (x / -1073741824 != x / m1073741824) bad = bad + 1;
+        if (x / -2147483647 != x / m2147483647) bad = bad + 1;
+        i = i + 1;
+    }
+
+    return bad;
+}
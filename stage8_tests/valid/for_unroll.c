@@ -0,0 +1,23 @@
+int main() {
+    int s = 0;
+    int k;
+    int n = 23;
+    for (int i = 0; i < 5; i = i + 1)
+        s = s + i * i;
+    for (k = 10; k > -7; k = k - 2) {
+        int t = k * 2;
+        s = s - t;
+    }
+    s = s + k;
+    for (int i = 3; i <= 40; i = i + 1) {
+        int a = i * 5;
+        s = s + a - a / 3;
+        if (s > 1000)
+            s = s - 1000;
+    }
+    for (int i = 0; i < n; i = i + 2)
+        s = s + i;
+    for (int i = n; i >= 0; i = i - 3)
+        s = s - i;
+    return s;
+}
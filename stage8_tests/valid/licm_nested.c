@@ -0,0 +1,32 @@
+int main() {
+    int n = 5;
+    int m = 3;
+    int zero = 0;
+    int s = 0;
+    for (int i = 0; i < 6; i = i + 1) {
+        int j = 0;
+        while (j < 4) {
+            s = s + (n * m + 2) + (i * 7 - n) / 3;
+            if (j > i)
+                break;
+            int k = 0;
+            do {
+                s = s + (n - m) * (i + 1) - -(n / 2);
+                k = k + 1;
+            } while (k < m - 1);
+            j = j + 1;
+        }
+        for (int k = 0; k < zero; k = k + 1)
+            s = s + n / zero;
+        if (zero)
+            s = s + m / zero;
+        int t = 0;
+        while (t < 2) {
+            int n = i + t;
+            s = s + n * 2;
+            t = t + 1;
+        }
+        s = s - (n * m + 2);
+    }
+    return s / 4;
+}
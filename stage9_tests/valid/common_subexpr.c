@@ -0,0 +1,32 @@
+int f(int x, int y) {
+    int r = x * y + x * y;
+    x = x + 1;
+    r = r + x * y;
+    if (y > 2)
+        r = r + x / y;
+    else
+        r = r - x / y;
+    return r + x / y;
+}
+int g(int a) { return a * 3; }
+int main() {
+    int a = 7;
+    int b = 3;
+    int s = 0;
+    int i = 0;
+    s = a * b + a * b;
+    if (s > 10) {
+        s = s + (a - b) * (a - b);
+    } else {
+        s = s - (a - b) * (a - b);
+    }
+    while (i < 5) {
+        s = s + a * b;
+        a = a + 1;
+        s = s + a * b;
+        i = i + 1;
+    }
+    s = s + g(a * b) + a * b;
+    s = s + f(a, b) + (a + b) * (b + a);
+    return s - (s / 256) * 256;
+}
@@ -0,0 +1,10 @@
+int f(int a, int b, int c) {
+    b = (a - 14) * -6;
+    if (c < 0)
+        return f(b, c, c + 1);
+    return c + b;
+}
+
+int main() {
+    return f(10, 3, 5);
+}
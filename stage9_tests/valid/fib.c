@@ -0,0 +1,12 @@
+int fib(int n) {
+    if (n == 0 || n == 1) {
+        return n;
+    } else {
+        return fib(n - 1) + fib(n - 2);
+    }
+}
+
+int main() {
+    int n = 10;
+    return fib(n);
+}
@@ -0,0 +1,9 @@
+int foo();
+
+int main() {
+    return foo();
+}
+
+int foo() {
+    return 3;
+}
@@ -0,0 +1,27 @@
+int f(int a, int b, int c) {
+    b = (((7 * 9) * -3) + ((11 < 8) + a));
+    return b + c;
+}
+int main() {
+    int s = 0;
+    if (10) {
+        for (int i = 0; i < 5; i = i + 1) {
+            if (15) {
+                int v = 7;
+                v = (f((v || v), 17, (v || v)) / -1);
+                s = s + v;
+                if ((7 * 9)) continue;
+            }
+        }
+    } else {
+        int w = 2;
+        for (int i = 0; i < 0; i = i + 1) {
+            for (int j = 0; j < 2; j = j + 1) {
+                int u = (13 / -4);
+                s = s + (f((4 * 10), (u - 3), 3) <= (w + 10));
+            }
+            if ((w * -3)) break;
+        }
+    }
+    return s;
+}
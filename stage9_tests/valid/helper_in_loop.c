@@ -0,0 +1,20 @@
+int square(int x) {
+    int result = x * x;
+    return result;
+}
+
+int clamp(int x, int low, int high) {
+    if (x < low)
+        return low;
+    if (x > high)
+        return high;
+    return x;
+}
+
+int main() {
+    int sum = 0;
+    for (int i = 0; i < 20; i = i + 1) {
+        sum = sum + clamp(square(i) - 10, 0, 100);
+    }
+    return sum / 10;
+}
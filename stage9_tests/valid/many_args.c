@@ -0,0 +1,21 @@
+int weigh(int a, int b, int c, int d, int e) {
+    return a + 2 * b + 3 * c + 4 * d + 5 * e;
+}
+
+int pick(int a, int b, int c, int d, int e) {
+    if (a > 50)
+        return weigh(e, d, c, b, a - 50);
+    return weigh(a, b, c, d, e);
+}
+
+int count(int n, int acc, int step) {
+    if (n == 0)
+        return acc;
+    return count(n - 1, acc + step, step);
+}
+
+int main() {
+    int x = pick(1, 2, 3, 4, 5);
+    int y = pick(weigh(1, 1, 1, 1, 1), x, 0, count(4, 0, 3), 1);
+    return (x + y + count(10, 1, 2)) / 3;
+}
@@ -0,0 +1,15 @@
+int is_even(int n);
+
+int is_odd(int n) {
+    return n == 0 ? 0 : is_even(n - 1);
+}
+
+int is_even(int n) {
+    if (n == 0)
+        return 1;
+    return is_odd(n - 1);
+}
+
+int main() {
+    return is_even(77) + 2 * is_odd(77);
+}
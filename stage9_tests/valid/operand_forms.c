@@ -0,0 +1,19 @@
+int f(int x, int y) {
+    return x - y;
+}
+
+int main() {
+    int a = 7; int b = -3; int c = 12; int d = 5; int e = 9; int g = 2;
+    int r = 0;
+    if (a < b) r = r + 1;
+    if (c >= d) r = r + 2;
+    if (5 < e) r = r + 4;
+    if (!(a == 7)) r = r + 8;
+    if (a + b * 4 - 1 != 0) r = r + 16;
+    r = r + (c - a) * (d - g) / (b - 1);
+    r = r + c / d + e / 3 + (100 - e) + -f(a, b) * 3;
+    r = r + (f(c, d) < f(a, g)) + !f(e, e) + (10 - f(1, 2)) / (f(3, 1) - 7);
+    while (a > 0 && !(c < d)) { a = a - 1; c = c - d / 2; }
+    r = r + (e ? a : c) + (a + b + c + d + e + g) * 9 + g * 8 + b * 3;
+    return r;
+}
@@ -0,0 +1,12 @@
+int g(int a, int b, int c, int d, int e, int f, int h, int i) {
+    return a - b + c * 2 - d + e * 3 - f + h * 5 - i;
+}
+
+int t(int a, int b, int c, int d, int e, int f, int h, int i) {
+    if (a > 3) return g(i, h, f, e, d, c, b, a);
+    return t(a + 1, b, c, d, e, f, h, i + a);
+}
+
+int main() {
+    return t(0, 2, 3, 4, 5, 6, 7, 8) + g(1, 2, 3, 4, 5, 6, 7, 8);
+}
@@ -0,0 +1,17 @@
+int is_even(int n, int unused);
+
+int is_odd(int n, int unused) {
+    if (n == 0)
+        return 0;
+    return is_even(n - 1, unused);
+}
+
+int is_even(int n, int unused) {
+    if (n == 0)
+        return 1;
+    return is_odd(n - 1, unused);
+}
+
+int main() {
+    return is_even(10001, 5) + 2 * is_odd(10001, 5);
+}
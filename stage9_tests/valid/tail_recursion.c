@@ -0,0 +1,9 @@
+int sum(int n, int acc) {
+    if (n == 0)
+        return acc;
+    return sum(n - 1, acc + n - (n / 7) * 7);
+}
+
+int main() {
+    return sum(100000, 0) / 1000;
+}
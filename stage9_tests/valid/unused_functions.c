@@ -0,0 +1,27 @@
+int square(int x) {
+    return x * x;
+}
+
+int unused(int a, int b) {
+    return square(a) - b;
+}
+
+int also_unused() {
+    return unused(1, 2);
+}
+
+int count(int n) {
+    int steps = 0;
+    while (n > 1) {
+        n = n / 2;
+        steps = steps + 1;
+    }
+    return steps;
+}
+
+int main() {
+    int a = 5;
+    square(a + 1);
+    count(a);
+    return square(a) + count(64);
+}